@@ -0,0 +1,159 @@
+// Force fields and obstacles of the scene, shared by the particle and cloth
+// update shaders. The FieldStore fills FieldBlock once per frame. The including
+// shader declares int Layers: fields and obstacles only act on it if their
+// layers share a bit with it.
+
+struct directionalForceField{
+	vec3 position;
+	float radius;
+	vec3 force;
+	int layers;
+};
+
+// Only x of the force is used, so all sphere fields have the same layout
+struct expansionForceField{
+	vec3 position;
+	float radius;
+	vec3 force;
+	int layers;
+};
+
+struct contractionForceField{
+	vec3 position;
+	float radius;
+	vec3 force;
+	int layers;
+};
+
+struct cuboidObstacle{
+	vec3 pos;      //Position are the smallest x,y,z coordinates, not the center
+	float scale;
+	vec3 size;
+	int layers;
+};
+
+struct meshObstacle{
+	vec3 position; //Center of the bake domain in world space
+	float scale;
+	vec3 halfSize; //Half extent of the bake domain in mesh space
+	int layers;
+	mat4 rotation; //Mesh to world space, only the rotation part is set
+};
+
+layout(std140) uniform FieldBlock{
+	int numDirectionalForceFields;
+	int numExpansionForceFields;
+	int numContractionForceFields;
+	int numCuboidObstacles;
+	int numMeshObstacles;
+	directionalForceField directionalForceFields[10];
+	expansionForceField expansionForceFields[10];
+	contractionForceField contractionForceFields[10];
+	cuboidObstacle cuboidObstacles[10];
+	meshObstacle meshObstacles[4];
+};
+
+// Shader variants. The ParticleManager compiles permutations of its update
+// shader with an upper bound on the number of fields of each type: 0, 2 or the
+// array size. Loops over absent field types compile away and short ones unroll.
+#ifndef MAX_DIRECTIONAL_FIELDS
+#define MAX_DIRECTIONAL_FIELDS 10
+#endif
+#ifndef MAX_EXPANSION_FIELDS
+#define MAX_EXPANSION_FIELDS 10
+#endif
+#ifndef MAX_CONTRACTION_FIELDS
+#define MAX_CONTRACTION_FIELDS 10
+#endif
+#ifndef MAX_CUBOID_OBSTACLES
+#define MAX_CUBOID_OBSTACLES 10
+#endif
+#ifndef MAX_MESH_OBSTACLES
+#define MAX_MESH_OBSTACLES 4
+#endif
+
+// Fields push with their full force inside their radius
+vec3 getDirectionalForceFieldInfluence(vec3 pos){
+	vec3 totalForce = vec3(0,0,0);
+	for( int i = 0; i < MAX_DIRECTIONAL_FIELDS && i < numDirectionalForceFields; ++i ){
+		if( (directionalForceFields[i].layers & Layers) == 0 ) continue;
+		if( distance(pos, directionalForceFields[i].position) < directionalForceFields[i].radius )
+			totalForce += directionalForceFields[i].force;
+	}
+	return totalForce;
+}
+
+// Expansion and contraction fields fall off linearly towards their radius
+vec3 getExpansionForceFieldInfluence(vec3 pos){
+	vec3 totalForce = vec3(0,0,0);
+	for( int i = 0; i < MAX_EXPANSION_FIELDS && i < numExpansionForceFields; ++i ){
+		if( (expansionForceFields[i].layers & Layers) == 0 ) continue;
+		vec3 d = pos - expansionForceFields[i].position;
+		float dist = length(d);
+		if( dist > 0.0 && dist < expansionForceFields[i].radius )
+			totalForce += d / dist * expansionForceFields[i].force.x * (1.0 - dist / expansionForceFields[i].radius);
+	}
+	return totalForce;
+}
+
+vec3 getContractionForceFieldInfluence(vec3 pos){
+	vec3 totalForce = vec3(0,0,0);
+	for( int i = 0; i < MAX_CONTRACTION_FIELDS && i < numContractionForceFields; ++i ){
+		if( (contractionForceFields[i].layers & Layers) == 0 ) continue;
+		vec3 d = contractionForceFields[i].position - pos;
+		float dist = length(d);
+		if( dist > 0.0 && dist < contractionForceFields[i].radius )
+			totalForce += d / dist * contractionForceFields[i].force.x * (1.0 - dist / contractionForceFields[i].radius);
+	}
+	return totalForce;
+}
+
+// Sweeps the segment from -> to against all cuboid obstacles. Returns true for a hit,
+// with the time of impact in [0,1] along the segment and the normal of the face that was hit.
+bool sweepCuboidObstacles(vec3 from, vec3 to, out float tHit, out vec3 normal){
+	vec3 dir = to - from;
+	// Avoid divisions by zero for axis-parallel segments
+	vec3 safeDir = mix(dir, vec3(1e-8), lessThan(abs(dir), vec3(1e-8)));
+	vec3 invDir = 1.0 / safeDir;
+	bool hit = false;
+	tHit = 1.0;
+	normal = vec3(0);
+
+	for( int i = 0; i < MAX_CUBOID_OBSTACLES && i < numCuboidObstacles; ++i ){
+		if( (cuboidObstacles[i].layers & Layers) == 0 ) continue;
+		vec3 t0 = (cuboidObstacles[i].pos - from) * invDir;
+		vec3 t1 = (cuboidObstacles[i].pos + cuboidObstacles[i].size - from) * invDir;
+		vec3 tNear = min(t0, t1);
+		vec3 tFar = max(t0, t1);
+		float tEnter = max(max(tNear.x, tNear.y), tNear.z);
+		float tExit = min(min(tFar.x, tFar.y), tFar.z);
+		// Segments starting inside a box are resolved by pushOutOfCuboidObstacles
+		if( tEnter <= tExit && tEnter >= 0.0 && tEnter < tHit ){
+			hit = true;
+			tHit = tEnter;
+			if( tEnter == tNear.x ) normal = vec3(-sign(safeDir.x), 0, 0);
+			else if( tEnter == tNear.y ) normal = vec3(0, -sign(safeDir.y), 0);
+			else normal = vec3(0, 0, -sign(safeDir.z));
+		}
+	}
+	return hit;
+}
+
+// Moves a point that ended up inside an obstacle to the closest face
+void pushOutOfCuboidObstacles(inout vec3 pos, inout vec3 vel, float bounciness){
+	for( int i = 0; i < MAX_CUBOID_OBSTACLES && i < numCuboidObstacles; ++i ){
+		if( (cuboidObstacles[i].layers & Layers) == 0 ) continue;
+		vec3 lower = cuboidObstacles[i].pos;
+		vec3 upper = lower + cuboidObstacles[i].size;
+		if( any(lessThan(pos, lower)) || any(greaterThan(pos, upper)) ) continue;
+
+		vec3 toLower = pos - lower;
+		vec3 toUpper = upper - pos;
+		vec3 depth = min(toLower, toUpper);
+		int axis = depth.x < depth.y ? (depth.x < depth.z ? 0 : 2) : (depth.y < depth.z ? 1 : 2);
+		vec3 n = vec3(0);
+		n[axis] = toLower[axis] < toUpper[axis] ? -1.0 : 1.0;
+		pos += n * (depth[axis] + 1e-4);
+		vel -= (1.0 + bounciness) * min(dot(vel, n), 0.0) * n;
+	}
+}
@@ -0,0 +1,17 @@
+#version 150
+
+uniform mat4 ciModelViewProjection;
+
+in vec4 ciPosition;
+
+// Per instance, from the ParticleManager's gizmo buffers
+in vec3 InstancePosition;
+in vec3 InstanceScale; // Radius of spheres, size of cuboids
+in vec4 InstanceColor;
+
+out vec4 Color;
+
+void main() {
+	Color = InstanceColor;
+	gl_Position = ciModelViewProjection * vec4(ciPosition.xyz * InstanceScale + InstancePosition, 1.0);
+}
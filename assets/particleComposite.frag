@@ -0,0 +1,35 @@
+#version 150
+
+// Upsamples the reduced resolution particle layer. Of the four low resolution
+// texels around a pixel, the ones whose depth matches the pixel's scene depth
+// get the weight, so particles don't bleed over the edges of closer geometry.
+
+uniform sampler2D ParticleColor; // Premultiplied alpha
+uniform sampler2D ParticleDepth; // Scene depth the particles were tested against
+uniform sampler2D SceneDepth; // Full resolution
+uniform ivec2 LowResSize;
+
+in vec2 TexCoord;
+
+out vec4 FragColor;
+
+void main() {
+	float depth = texelFetch(SceneDepth, ivec2(gl_FragCoord.xy), 0).r;
+
+	vec2 pos = TexCoord * vec2(LowResSize) - 0.5;
+	ivec2 base = ivec2(floor(pos));
+	vec2 f = pos - vec2(base);
+
+	vec4 color = vec4(0);
+	float weights = 0;
+	for( int i = 0; i < 4; ++i ){
+		ivec2 offset = ivec2(i & 1, i >> 1);
+		ivec2 texel = clamp(base + offset, ivec2(0), LowResSize - 1);
+		vec2 bilinear = mix(1 - f, f, vec2(offset));
+		float lowDepth = texelFetch(ParticleDepth, texel, 0).r;
+		float w = bilinear.x * bilinear.y / (1e-4 + abs(lowDepth - depth));
+		color += texelFetch(ParticleColor, texel, 0) * w;
+		weights += w;
+	}
+	FragColor = color / max(weights, 1e-8);
+}
@@ -7,10 +7,13 @@ in vec4 VertexColor;
 out vec2 center;
 
 uniform mat4 ciModelViewProjection;
+uniform float PointSize = 5;
 
 void main() {
 	gl_Position = ciModelViewProjection * vec4(VertexPosition, 1.0);
+	// Dead particles are moved behind the far plane
+	if( VertexStartTime < 0 ) gl_Position = vec4(0, 0, 2, 1);
 
-	gl_PointSize =5;
+	gl_PointSize = PointSize;
 
 }
\ No newline at end of file
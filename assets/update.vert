@@ -38,6 +38,14 @@ uniform float c = 1.8;
 // Spring resting length
 uniform float rest_length = 0.2;
 
+// The scene's force fields and obstacles act on the cloth if their layers
+// share a bit with these. Field forces are scaled down to the cloth's units.
+uniform int Layers = -1;
+uniform float FieldStrength = 0.01;
+uniform float Bounciness = 0.2;
+
+#include "fields.glsl"
+
 
 void main(void)
 {
@@ -50,6 +58,8 @@ void main(void)
 	float m = position_mass.w;     // m is the mass of our vertex
 	vec3 u = velocity;             // u is the initial velocity
 	vec3 F = gravity *  m - c * u;  // F is the force on the mass
+	F += FieldStrength * m * (getDirectionalForceFieldInfluence(p) + getExpansionForceFieldInfluence(p)
+		+ getContractionForceFieldInfluence(p));
 	bool fixed_node = true;        // Becomes false when force is applied
 	
 	for( int i = 0; i < 4; i++) {
@@ -80,7 +90,11 @@ void main(void)
 	// Constrain the absolute value of the displacement per step
 	s = clamp(s, vec3(-25.0), vec3(25.0));
 	
+	// Nodes that ended up inside an obstacle are moved out, fixed nodes stay put
+	vec3 next = p + s;
+	if( !fixed_node ) pushOutOfCuboidObstacles(next, v, Bounciness);
+
 	// Write the outputs
-	tf_position_mass = vec4(p + s, m);
+	tf_position_mass = vec4(next, m);
 	tf_velocity = v;
 }
@@ -5,101 +5,266 @@ in vec3 VertexVelocity;
 in float VertexStartTime;
 in vec3 VertexInitialVelocity;
 in vec3 VertexInitialPosition;
+in vec2 VertexStepState; // Rest frames and the time the particle was last integrated to
+in int VertexSystem; // Index of the particle system this particle belongs to
 in vec4 VertexColor;
 
 out vec3 Position; // To Transform Feedback
 out vec3 Velocity; // To Transform Feedback
 out vec4 Color; // To Transform Feedback
 out float StartTime; // To Transform Feedback
+out vec2 StepState; // To Transform Feedback
+
+// Unpacked from and into StepState
+float RestFrames;
+float StepTime;
 
 uniform float Time; // Time
-uniform float H;	// Elapsed time between frames
-uniform float ParticleLifetime = 3.0f; // Particle lifespan
-uniform float ParticleBounciness = 0.01f; // Particle bounciness
-uniform float DragCoefficient = 0.0f; // Drag coefficient
-
-struct directionalForceField{
-	vec3 position;
-	float radius;
-	vec3 force;
+uniform float H;	// Simulation timestep
+
+// Several particle systems share the buffers, each one owns the contiguous
+// range [first, first + count) and only its first activeCount particles are simulated.
+struct particleSystem{
+	int first;
+	int activeCount;
+	float lifetime;
+	float bounciness;
+	float drag;
+	int layers; // Fields and obstacles affect this system if their layers share a bit
+	bool recycle; // Dead particles respawn at their initial position, or stay dead
 };
 
-uniform int numDirectionalForceFields;
-uniform directionalForceField directionalForceFields[10];
+uniform particleSystem particleSystems[16];
 
-struct expansionForceField{
-	vec3 position;
-	float radius;
-	float force;
-};
+// Particles spawned from the CPU. The spawn system is used as a FIFO ring:
+// this frame's batch overwrites the SpawnCount slots starting at SpawnCursor,
+// which are the oldest ones. Each spawned particle takes two texels in
+// SpawnData, the position and the velocity, starting at SpawnOffset.
+uniform int SpawnSystem = -1;
+uniform int SpawnCursor;
+uniform int SpawnCount = 0;
+uniform int SpawnOffset;
+uniform samplerBuffer SpawnData;
 
-uniform int numExpansionForceFields;
-uniform expansionForceField expansionForceFields[10];
+// Settings of the system the current particle belongs to, set up in main
+float ParticleLifetime; // Particle lifespan
+float ParticleBounciness; // Particle bounciness
+float DragCoefficient; // Drag coefficient
+int Layers;
 
-struct contractionForceField{
-	vec3 position;
-	float radius;
-	float force;
-};
+// Simulation level of detail. Particles far from the camera or outside the
+// view frustum are only stepped every k-th frame. Each step integrates the time
+// since the particle's last step, so moving between bands, sorting or being
+// spawned never gains or loses simulated time. The phase is shared by blocks
+// of LOD_BLOCK consecutive particles, so whole warps skip the integration
+// together instead of diverging lane by lane. Spatially sorted buffers (Morton
+// order) keep the strides within a block alike.
+#define LOD_BLOCK 64
+uniform bool LodEnabled = false;
+uniform vec3 CameraPosition;
+uniform mat4 ViewProjection;
+uniform float LodNearDistance = 8.0f; // Particles closer than this are stepped every frame
+uniform int LodInterval = 4; // Step interval for far particles, offscreen ones use twice that
+uniform float MaxLodTimestep = 0.1f; // A particle is stepped before its pending time would exceed this
+uniform int FrameIndex;
 
-uniform int numContractionForceFields;
-uniform contractionForceField contractionForceFields[10];
+// Sleeping. A particle whose speed stays below SleepVelocity for SleepFrames
+// steps falls asleep and is skipped until something near it changes.
+uniform bool SleepEnabled = true;
+uniform float SleepVelocity = 0.05f;
+uniform int SleepFrames = 30;
+uniform bool WakeAll = false; // Set when a global parameter changed
 
-struct cuboidObstacle{
-	vec3 pos;      //Position are the smallest x,y,z coordinates, not the center
-	vec3 size;
+struct wakeRegion{
+	vec3 lower;
+	vec3 upper;
 };
 
-uniform int numCuboidObstacles;
-uniform cuboidObstacle cuboidObstacles[10];
+uniform int numWakeRegions;
+uniform wakeRegion wakeRegions[8];
+
+#include "fields.glsl"
+
+// Baked signed distance fields of the mesh obstacles, gradient in rgb and distance in a
+uniform sampler3D meshObstacleSdfs[4];
 
-//todo: Task2, please read the help section!
-vec3 getDirectionalForceFieldInfluence(vec3 pos){
-	vec3 totalForce = vec3(0,0,0);
+// The drag term compiles away in variants without drag
+#ifndef USE_DRAG
+#define USE_DRAG 1
+#endif
 
-	return totalForce;
+// Quadratic drag, integrated implicitly: v / (1 + c|v|h) never overshoots
+// zero, whatever the coefficient and the (LOD enlarged) timestep. The slab
+// workers on the CPU use the same form.
+vec3 applyDrag(vec3 velocity, float h){
+#if USE_DRAG
+	return velocity / (1.0 + DragCoefficient * length(velocity) * h);
+#else
+	return velocity;
+#endif
 }
 
-vec3 getExpansionForceFieldInfluence(vec3 pos){
-	vec3 totalForce = vec3(0,0,0);
-	
-	return totalForce;
+// Number of frames between two updates of a particle at this position
+int getLodStride(vec3 pos){
+	if( !LodEnabled ) return 1;
+
+	vec4 clip = ViewProjection * vec4(pos, 1.0);
+	bool visible = clip.w > 0.0 && all(lessThanEqual(abs(clip.xyz), vec3(clip.w * 1.1)));
+	int stride = 1;
+	if( !visible ) stride = LodInterval * 2;
+	else if( distance(pos, CameraPosition) > LodNearDistance ) stride = LodInterval;
+	return clamp(stride, 1, max(int(MaxLodTimestep / H), 1));
 }
 
-vec3 getContractionForceFieldInfluence(vec3 pos){
-	vec3 totalForce = vec3(0,0,0);
-	
-	return totalForce;
+bool isWoken(vec3 pos){
+	if( WakeAll ) return true;
+	for( int i = 0; i < numWakeRegions; ++i ){
+		if( all(greaterThanEqual(pos, wakeRegions[i].lower)) && all(lessThanEqual(pos, wakeRegions[i].upper)) )
+			return true;
+	}
+	return false;
 }
 
-vec3 getDragForce(vec3 velocity){
-	return vec3(0);
+vec4 sampleMeshObstacle(int i, vec3 uvw){
+	// Sampler arrays may only be indexed with constant expressions
+	if( i == 0 ) return texture(meshObstacleSdfs[0], uvw);
+	if( i == 1 ) return texture(meshObstacleSdfs[1], uvw);
+	if( i == 2 ) return texture(meshObstacleSdfs[2], uvw);
+	return texture(meshObstacleSdfs[3], uvw);
 }
 
-void main() {
-	// Update position & velocity for next frame
-	Position = VertexPosition;
-	Velocity = VertexVelocity;
-	StartTime = VertexStartTime;
+// Pushes a point inside a mesh obstacle back to its surface along the field gradient
+void collideMeshObstacles(inout vec3 pos, inout vec3 vel){
+	for( int i = 0; i < MAX_MESH_OBSTACLES && i < numMeshObstacles; ++i ){
+		if( (meshObstacles[i].layers & Layers) == 0 ) continue;
+		// The texture is baked in mesh space, the inverse rotation takes the point there
+		mat3 rotation = mat3(meshObstacles[i].rotation);
+		vec3 local = transpose(rotation) * (pos - meshObstacles[i].position);
+		vec3 uvw = local / (meshObstacles[i].scale * meshObstacles[i].halfSize) * 0.5 + 0.5;
+		if( any(lessThan(uvw, vec3(0))) || any(greaterThan(uvw, vec3(1))) ) continue;
+
+		vec4 field = sampleMeshObstacle(i, uvw);
+		float dist = field.a * meshObstacles[i].scale;
+		if( dist >= 0.0 ) continue;
+
+		// The gradient vanishes where the field has no direction, e.g. on the medial axis
+		float gradient = length(field.xyz);
+		if( gradient < 1e-6 ) continue;
+		vec3 n = rotation * (field.xyz / gradient);
+		pos += n * (1e-3 - dist);
+		vel -= (1.0 + ParticleBounciness) * min(dot(vel, n), 0.0) * n;
+	}
+}
+
+void integrate(inout vec3 pos, inout vec3 vel, float h){
+	vec3 oldPos = pos;
+	// Particles have unit mass, so the forces are the acceleration
+	vec3 force = getDirectionalForceFieldInfluence(pos) + getExpansionForceFieldInfluence(pos)
+		+ getContractionForceFieldInfluence(pos);
+	vel = applyDrag(vel + force * h, h);
+	pos += vel * h;
+
+	// Continuous collision: the path oldPos -> pos is swept against the obstacles,
+	// so fast particles and large timesteps can't tunnel through thin walls.
+	// After a hit the remaining part of the step continues with the reflected
+	// velocity, which may hit another face (e.g. in a corner).
+	float remaining = 1.0;
+	for( int bounce = 0; bounce < 3; ++bounce ){
+		float tHit;
+		vec3 n;
+		if( !sweepCuboidObstacles(oldPos, pos, tHit, n) ) break;
+
+		vec3 contact = mix(oldPos, pos, tHit) + n * 1e-4;
+		vel -= (1.0 + ParticleBounciness) * dot(vel, n) * n;
+		remaining *= 1.0 - tHit;
+		oldPos = contact;
+		pos = contact + vel * h * remaining;
+	}
+	pushOutOfCuboidObstacles(pos, vel, ParticleBounciness);
+	collideMeshObstacles(pos, vel);
+}
+
+void step() {
+	particleSystem system = particleSystems[VertexSystem];
+	ParticleLifetime = system.lifetime;
+	ParticleBounciness = system.bounciness;
+	DragCoefficient = system.drag;
+	Layers = system.layers;
+
+	int slot = gl_VertexID - system.first;
+	if( VertexSystem == SpawnSystem ) {
+		int count = particleSystems[SpawnSystem].activeCount;
+		int spawned = (slot - SpawnCursor + count) % count;
+		if( spawned < SpawnCount ) {
+			int texel = (SpawnOffset + spawned) * 2;
+			Position = texelFetch(SpawnData, texel).xyz;
+			Velocity = texelFetch(SpawnData, texel + 1).xyz;
+			StartTime = Time;
+			RestFrames = 0;
+			StepTime = Time;
+			return;
+		}
+	}
+
+	// Particles beyond the active part of their system are passed through, and
+	// resume without a backlog of time once they are active again
+	if( slot >= system.activeCount ) {
+		StepTime = Time;
+		return;
+	}
+	// Dead particles of systems that don't recycle have a negative start time
+	if( StartTime < 0 ) return;
 
 	if( Time >= StartTime ) {
 		
 		float age = Time - StartTime;
 		
-		if( age > ParticleLifetime ) {
+		if( age > ParticleLifetime && !system.recycle ) {
+			StartTime = -1;
+		}
+		else if( age > ParticleLifetime ) {
 			// The particle is past it's lifetime, recycle.
 			Position = VertexInitialPosition;
 			Velocity = VertexInitialVelocity;
 			StartTime = Time;
+			RestFrames = 0;
+			StepTime = Time;
+		}
+		else if( SleepEnabled && RestFrames >= SleepFrames && !isWoken(Position) ) {
+			// The particle is asleep, it is passed through unchanged and
+			// wakes up without a backlog of time.
+			StepTime = Time;
 		}
 		else {
-			// The particle is alive, update.
-			vec3 oldPos = Position;
-			Position += Velocity * H;
-			//todo Task2: (you can also define your own function/s)
-
-			//todo Task3 & 4: Add your collision detection functions here
-
+			if( RestFrames >= SleepFrames ) RestFrames = 0;
+			// The particle is alive, update. Blocks are offset by their index,
+			// so only 1/stride of the blocks is stepped in any given frame. A
+			// particle whose band changed is stepped before its time runs over.
+			// Born this frame, it has only been alive since its start time.
+			float elapsed = Time - max(StepTime, StartTime);
+			int stride = getLodStride(Position);
+			if( (FrameIndex + gl_VertexID / LOD_BLOCK) % stride == 0 || elapsed + H > MaxLodTimestep ) {
+				integrate(Position, Velocity, elapsed);
+				StepTime = Time;
+				RestFrames = length(Velocity) < SleepVelocity ? RestFrames + 1 : 0;
+			}
 		}
 	}
-}
\ No newline at end of file
+	else {
+		// Not born yet
+		StepTime = Time;
+	}
+}
+
+void main() {
+	// Update position & velocity for next frame
+	Position = VertexPosition;
+	Velocity = VertexVelocity;
+	StartTime = VertexStartTime;
+	RestFrames = VertexStepState.x;
+	StepTime = VertexStepState.y;
+
+	step();
+
+	StepState = vec2(RestFrames, StepTime);
+}
@@ -6,7 +6,6 @@ ClothSimulator::ClothSimulator(CameraPersp* cam)
 	setupBuffers();
 	setupGlsl();
 	mIterationsPerFrame = 20;
-	getWindow()->getApp()->getSignalUpdate().connect(std::bind(&ClothSimulator::update, this));
 }
 
 void ClothSimulator::draw()
@@ -15,7 +14,7 @@ void ClothSimulator::draw()
 	// Notice that this vao holds the buffers we've just
 	// written to with Transform Feedback. It will show
 	// the most recent positions
-	gl::ScopedVao scopeVao(mVaos[mIterationIndex & 1]);
+	gl::ScopedVao scopeVao(mVaos[getCurrentSlot()]);
 	gl::ScopedGlslProg scopeGlsl(mRenderGlsl);
 	gl::setMatrices(*mCam);
 	gl::setDefaultShaderVars();
@@ -27,6 +26,17 @@ void ClothSimulator::draw()
 	gl::drawElements(GL_LINES, CONNECTIONS_TOTAL * 2, GL_UNSIGNED_INT, nullptr);
 }
 
+void ClothSimulator::setBufferDepth(int depth)
+{
+	mBufferDepth = glm::clamp(depth, 2, 4);
+	if (mBufferDepth != getBufferDepth()) setupBuffers();
+}
+
+void ClothSimulator::setIterationsPerFrame(uint32_t iterations)
+{
+	mIterationsPerFrame = std::max(iterations, 1u);
+}
+
 void ClothSimulator::setupBuffers() 
 {
 	int i, j;
@@ -35,6 +45,16 @@ void ClothSimulator::setupBuffers()
 	std::array<vec3, POINTS_TOTAL> velocities;
 	std::array<ivec4, POINTS_TOTAL> connections;
 
+	// On a rebuild the cloth keeps its current state
+	bool rebuild = mSlotFences != nullptr;
+	if (rebuild) {
+		mSlotFences->waitReleased(getCurrentSlot());
+		gl::ScopedBuffer positionScope(GL_ARRAY_BUFFER, getPositions()->getId());
+		glGetBufferSubData(GL_ARRAY_BUFFER, 0, positions.size() * sizeof(vec4), positions.data());
+		gl::ScopedBuffer velocityScope(GL_ARRAY_BUFFER, getVelocities()->getId());
+		glGetBufferSubData(GL_ARRAY_BUFFER, 0, velocities.size() * sizeof(vec3), velocities.data());
+	}
+
 	int n = 0;
 	for (j = 0; j < POINTS_Y; j++) {
 		float fj = (float)j / (float)POINTS_Y;
@@ -42,12 +62,12 @@ void ClothSimulator::setupBuffers()
 			float fi = (float)i / (float)POINTS_X;
 
 			// create our initial positions, Basically a plane
-			positions[n] = vec4((fi - 0.5f) * (float)POINTS_X * 0.2f,
+			if (!rebuild) positions[n] = vec4((fi - 0.5f) * (float)POINTS_X * 0.2f,
 				(fj - 0.5f) * (float)POINTS_Y *0.2f ,
 				0.6f * sinf(fi) * cosf(fj),
 				1.0f);
 			// zero out velocities
-			velocities[n] = vec3(0.0f);
+			if (!rebuild) velocities[n] = vec3(0.0f);
 			// to create connections we'll use an integer buffer.
 			// The value -1 refers to the fact that there's no
 			// connection. This helps for the edge cases of the plane
@@ -66,7 +86,15 @@ void ClothSimulator::setupBuffers()
 		}
 	}
 
-	for (i = 0; i < 2; i++) {
+	mSlotFences.reset(new FenceRing("ClothSimulator", mBufferDepth));
+	mCurrentSlot = 0;
+	int slots = mBufferDepth + 1;
+	mVaos.resize(slots);
+	mPositions.resize(slots);
+	mVelocities.resize(slots);
+	mConnections.resize(slots);
+	mPositionBufTexs.resize(slots);
+	for (i = 0; i < slots; i++) {
 		mVaos[i] = gl::Vao::create();
 		gl::ScopedVao scopeVao(mVaos[i]);
 		{
@@ -96,9 +124,9 @@ void ClothSimulator::setupBuffers()
 			}
 		}
 	}
-	// create your two BufferTextures that correspond to your position buffers.
-	mPositionBufTexs[0] = gl::BufferTexture::create(mPositions[0], GL_RGBA32F);
-	mPositionBufTexs[1] = gl::BufferTexture::create(mPositions[1], GL_RGBA32F);
+	// create the BufferTextures that correspond to your position buffers.
+	for (i = 0; i < slots; i++)
+		mPositionBufTexs[i] = gl::BufferTexture::create(mPositions[i], GL_RGBA32F);
 
 	int lines = (POINTS_X - 1) * POINTS_Y + (POINTS_Y - 1) * POINTS_X;
 	// create the indices to draw links between the cloth points
@@ -140,6 +168,8 @@ void ClothSimulator::setupGlsl()
 		.feedbackVaryings(feedbackVaryings);
 
 	mUpdateGlsl = gl::GlslProg::create(updateFormat);
+	mUpdateGlsl->uniform("rest_length", CLOTH_REST_LENGTH);
+	FieldStore::attach(mUpdateGlsl);
 
 	gl::GlslProg::Format renderFormat;
 	renderFormat.vertex(loadAsset("render.vert"))
@@ -154,26 +184,36 @@ void ClothSimulator::update()
 
 	gl::ScopedGlslProg	scopeGlsl(mUpdateGlsl);
 	gl::ScopedState		scopeState(GL_RASTERIZER_DISCARD, true);
+	if (mFieldStore) mFieldStore->bind();
+	mUpdateGlsl->uniform("FieldStrength", mFieldStore ? fieldStrength : 0.0f);
+	mUpdateGlsl->uniform("Layers", layers);
+	// The iteration count trades accuracy for time, not cloth speed
+	mUpdateGlsl->uniform("t", CLOTH_FRAME_TIME / mIterationsPerFrame);
 	
+	// The iterations ping-pong between the next ring slot and the scratch
+	// slot, in the order that leaves the last one in the ring slot. So the
+	// ring moves one slot per frame, whatever the iteration count.
+	int output = (mCurrentSlot + 1) % getBufferDepth();
+	int scratch = getBufferDepth();
+	int input = mCurrentSlot;
 	for (auto i = mIterationsPerFrame; i != 0; --i) {
 		// Bind the vao that has the original vbo attached,
 		// these buffers will be used to read from.
-		gl::ScopedVao scopedVao(mVaos[mIterationIndex & 1]);
+		gl::ScopedVao scopedVao(mVaos[input]);
 		// Bind the BufferTexture, which contains the positions
 		// of the first vbo. We'll cycle through the neighbors
 		// using the connection buffer so that we can derive our
 		// next position and velocity to write to Transform Feedback
-		gl::ScopedTextureBind scopeTex(mPositionBufTexs[mIterationIndex & 1]->getTarget(), mPositionBufTexs[mIterationIndex & 1]->getId());
+		gl::ScopedTextureBind scopeTex(mPositionBufTexs[input]->getTarget(), mPositionBufTexs[input]->getId());
 
 		mUpdateGlsl->uniform("wind", wind);
-		// We iterate our index so that we'll be using the
-		// opposing buffers to capture the data
-		mIterationIndex++;
+		// Odd iterations left to go write the ring slot, even ones the scratch
+		int target = (i % 2 == 1) ? output : scratch;
 		
 		// Now bind our opposing buffers to the correct index
 		// so that we can capture the values coming from the shader
-		gl::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, POSITION_INDEX, mPositions[mIterationIndex & 1]);
-		gl::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, VELOCITY_INDEX, mVelocities[mIterationIndex & 1]);
+		gl::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, POSITION_INDEX, mPositions[target]);
+		gl::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, VELOCITY_INDEX, mVelocities[target]);
 		gl::setDefaultShaderVars();
 		// Begin Transform feedback with the correct primitive,
 		// In this case, we want GL_POINTS, because each vertex
@@ -185,6 +225,9 @@ void ClothSimulator::update()
 		// After that we issue an endTransformFeedback command
 		// to tell OpenGL that we're finished capturing vertices
 		gl::endTransformFeedback();
-		
+		input = target;
 	}
+	mCurrentSlot = output;
+	// Only the ring slot is ever read by the CPU
+	mSlotFences->fence(output);
 }
@@ -2,6 +2,8 @@
 #include "cinder/app/App.h"
 #include "cinder/gl/gl.h"
 #include "cinder/params/Params.h"
+#include "FenceRing.h"
+#include "FieldStore.h"
 
 using namespace ci;
 using namespace ci::app;
@@ -11,6 +13,8 @@ const uint32_t POINTS_X = 10;
 const uint32_t POINTS_Y = 10;
 const uint32_t POINTS_TOTAL = (POINTS_X * POINTS_Y);
 const uint32_t CONNECTIONS_TOTAL = (POINTS_X - 1) * POINTS_Y + (POINTS_Y - 1) * POINTS_X;
+const float CLOTH_REST_LENGTH = 0.2f;
+const float CLOTH_FRAME_TIME = 1.0f; /* Simulated time per frame, split over the iterations */
 
 const uint32_t POSITION_INDEX = 0;
 const uint32_t VELOCITY_INDEX = 1;
@@ -20,25 +24,50 @@ class ClothSimulator
 {
 public:
 	ClothSimulator(CameraPersp* cam);
+	void update();
 	void draw();
+	void setIterationsPerFrame(uint32_t iterations);
+
+	// State written by the last iteration, which is also what gets drawn
+	gl::VboRef getPositions() const { return mPositions[getCurrentSlot()]; }
+	gl::VboRef getVelocities() const { return mVelocities[getCurrentSlot()]; }
+	gl::VboRef getConnections() const { return mConnections[getCurrentSlot()]; }
+
+	// Every frame moves one slot along a ring of buffers. A deeper ring leaves
+	// slots the GPU is done with for the CPU to read.
+	void setBufferDepth(int depth);
+	int getBufferDepth() const { return int(mPositions.size()) - 1; }
+	const FenceRing* getSlotFences() const { return mSlotFences.get(); }
+
+	// The scene's fields and obstacles, read by every iteration
+	void setFieldStore(const FieldStore* store) { mFieldStore = store; }
 
 	bool wind = true;
+	float fieldStrength = 0.01f; /* Scales the field forces down to the cloth's units */
+	int layers = -1; /* Fields and obstacles affect the cloth if their layers share a bit with these */
 
 private:
 
 	void setupBuffers();
 	void setupGlsl();
-	void update();
 	
 
-	std::array<gl::VaoRef, 2>			mVaos;
-	std::array<gl::VboRef, 2>			mPositions, mVelocities, mConnections;
-	std::array<gl::BufferTextureRef, 2>	mPositionBufTexs;
+	int getCurrentSlot() const { return mCurrentSlot; }
+
+	// One slot per ring entry, plus a scratch slot at the end that takes the
+	// intermediate iterations of a frame
+	std::vector<gl::VaoRef>				mVaos;
+	std::vector<gl::VboRef>				mPositions, mVelocities, mConnections;
+	std::vector<gl::BufferTextureRef>	mPositionBufTexs;
+	std::unique_ptr<FenceRing>			mSlotFences;
+	int									mBufferDepth = 3;
+	int									mCurrentSlot = 0; /* Slot written by the last frame, which is drawn */
 	gl::VboRef							mLineIndices;
 	gl::GlslProgRef						mUpdateGlsl, mRenderGlsl;
+	const FieldStore*					mFieldStore = nullptr;
 
 	float								mCurrentCamRotation;
-	uint32_t							mIterationsPerFrame, mIterationIndex;
+	uint32_t							mIterationsPerFrame;
 	bool								mDrawPoints, mDrawLines, mUpdate;
 	CameraPersp*	mCam;
 
@@ -0,0 +1,48 @@
+#include "FenceRing.h"
+#include "cinder/Log.h"
+#include <chrono>
+
+FenceRing::FenceRing(const std::string& name, int depth)
+{
+	mName = name;
+	mFences.resize(std::max(depth, 1), nullptr);
+}
+
+FenceRing::~FenceRing()
+{
+	for (GLsync sync : mFences)
+		if (sync) glDeleteSync(sync);
+}
+
+void FenceRing::fence(int slot)
+{
+	if (mFences[slot]) glDeleteSync(mFences[slot]);
+	mFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+bool FenceRing::isReleased(int slot)
+{
+	GLsync& sync = mFences[slot];
+	if (!sync) return true;
+	if (glClientWaitSync(sync, 0, 0) == GL_TIMEOUT_EXPIRED) return false;
+	glDeleteSync(sync);
+	sync = nullptr;
+	return true;
+}
+
+bool FenceRing::waitReleased(int slot)
+{
+	if (isReleased(slot)) return false;
+
+	auto start = std::chrono::steady_clock::now();
+	GLsync& sync = mFences[slot];
+	while (glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+	glDeleteSync(sync);
+	sync = nullptr;
+
+	double waited = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	++mWaits;
+	mWaitTime += waited;
+	CI_LOG_W(mName << ": waited " << waited << " ms for slot " << slot << " to be released by the GPU");
+	return true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "cinder/gl/gl.h"
+#include <string>
+#include <vector>
+
+// One fence per slot of a ring of GPU buffers. Every submission the CPU must
+// not overlap with re-fences its slot: GPU reads of slots the CPU writes, GPU
+// writes of slots the CPU reads. A slot counts as released once that work has
+// finished. The CPU only touches released slots, and every time it has to
+// block for one the wait is counted and logged.
+class FenceRing {
+public:
+	FenceRing(const std::string& name, int depth);
+	~FenceRing();
+
+	int getDepth() const { return int(mFences.size()); }
+	// Call after submitting GL commands that conflict with the CPU's use of the slot
+	void fence(int slot);
+	// Doesn't block
+	bool isReleased(int slot);
+	// Blocks until the slot is released. Returns false if it didn't have to wait.
+	bool waitReleased(int slot);
+
+	uint32_t getWaits() const { return mWaits; }
+	double getWaitTime() const { return mWaitTime; } /* Total blocked time in milliseconds */
+
+private:
+	std::string mName;
+	std::vector<GLsync> mFences;
+	uint32_t mWaits = 0;
+	double mWaitTime = 0.0;
+};
@@ -0,0 +1,43 @@
+#include "FieldStore.h"
+#include <algorithm>
+#include <cstring>
+
+FieldStore::FieldStore()
+	: mFences("FieldStore", RING_DEPTH)
+{
+	std::memset(&mBlock, 0, sizeof(mBlock));
+	for (int i = 0; i < RING_DEPTH; ++i)
+		mUbos.push_back(gl::Ubo::create(sizeof(Block), &mBlock, GL_DYNAMIC_DRAW));
+}
+
+void FieldStore::upload(const FieldPack& pack)
+{
+	// Fields beyond the array sizes are dropped, like the uniform arrays did before
+	auto copy = [](const auto& source, auto* target, int capacity) {
+		int count = std::min(int(source.size()), capacity);
+		std::copy(source.begin(), source.begin() + count, target);
+		return count;
+	};
+	mBlock.numDirectionalForceFields = copy(pack.directional, mBlock.directional, MAX_FIELDS_PER_TYPE);
+	mBlock.numExpansionForceFields = copy(pack.expansion, mBlock.expansion, MAX_FIELDS_PER_TYPE);
+	mBlock.numContractionForceFields = copy(pack.contraction, mBlock.contraction, MAX_FIELDS_PER_TYPE);
+	mBlock.numCuboidObstacles = copy(pack.cuboids, mBlock.cuboids, MAX_FIELDS_PER_TYPE);
+	mBlock.numMeshObstacles = copy(pack.meshes, mBlock.meshes, MAX_MESH_OBSTACLES);
+
+	// Every pass reading the last buffer has been submitted by now. The next
+	// one was last read RING_DEPTH - 1 frames ago, so it is normally released.
+	mFences.fence(mSlot);
+	mSlot = (mSlot + 1) % RING_DEPTH;
+	mFences.waitReleased(mSlot);
+	mUbos[mSlot]->bufferSubData(0, sizeof(Block), &mBlock);
+}
+
+void FieldStore::bind() const
+{
+	mUbos[mSlot]->bindBufferBase(BINDING);
+}
+
+void FieldStore::attach(const gl::GlslProgRef& prog)
+{
+	prog->uniformBlock("FieldBlock", BINDING);
+}
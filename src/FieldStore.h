@@ -0,0 +1,79 @@
+#pragma once
+#include "cinder/gl/gl.h"
+#include "FenceRing.h"
+#include <vector>
+
+using namespace ci;
+using namespace std;
+
+// Force fields and obstacles as packed on the CPU once per frame
+struct PackedField {
+	vec3 position;
+	float radius;
+	vec3 force; /* Only x is used by expansion and contraction fields */
+	int layers;
+};
+struct PackedObstacle {
+	vec3 position; /* Lowest corner of cuboids, center of meshes */
+	float scale;
+	vec3 size; /* Size of cuboids, half size of the mesh bake domain */
+	int layers;
+};
+struct PackedMeshObstacle {
+	vec3 position; /* Center of the bake domain */
+	float scale;
+	vec3 size; /* Half size of the bake domain in mesh space */
+	int layers;
+	mat4 rotation; /* Mesh to world space, the upper 3x3 is used */
+};
+struct FieldPack {
+	std::vector<PackedField> directional, expansion, contraction;
+	std::vector<PackedObstacle> cuboids;
+	std::vector<PackedMeshObstacle> meshes;
+	std::vector<gl::Texture3dRef> meshSdfs;
+};
+
+// Scene-level copy of the fields in a uniform buffer, the FieldBlock of
+// fields.glsl. It is uploaded once per frame and read by every simulator
+// that includes fields.glsl, so they all see the same fields. Each frame
+// writes the next buffer of a small ring, so the upload never lands in a
+// buffer the GPU may still be reading for an earlier frame.
+class FieldStore {
+public:
+	static const int MAX_FIELDS_PER_TYPE = 10; /* Size of the arrays in FieldBlock */
+	static const int MAX_MESH_OBSTACLES = 4;
+	static const GLuint BINDING = 0; /* Uniform buffer binding point of FieldBlock */
+	static const int RING_DEPTH = 3; /* Frames in flight before an upload has to wait */
+
+	FieldStore();
+	// Call once per frame, after the fields were packed
+	void upload(const FieldPack& pack);
+	// Binds this frame's buffer for a simulation pass
+	void bind() const;
+	const FenceRing& getFences() const { return mFences; }
+	// Points the FieldBlock of a program at the binding
+	static void attach(const gl::GlslProgRef& prog);
+
+private:
+	// Mirrors FieldBlock in std140 layout
+	struct Block {
+		int numDirectionalForceFields;
+		int numExpansionForceFields;
+		int numContractionForceFields;
+		int numCuboidObstacles;
+		int numMeshObstacles;
+		int padding[3];
+		PackedField directional[MAX_FIELDS_PER_TYPE];
+		PackedField expansion[MAX_FIELDS_PER_TYPE];
+		PackedField contraction[MAX_FIELDS_PER_TYPE];
+		PackedObstacle cuboids[MAX_FIELDS_PER_TYPE];
+		PackedMeshObstacle meshes[MAX_MESH_OBSTACLES];
+	};
+	static_assert(sizeof(PackedField) == 32 && sizeof(PackedObstacle) == 32 && sizeof(PackedMeshObstacle) == 96,
+		"FieldBlock structs must match std140");
+
+	Block mBlock;
+	std::vector<gl::UboRef> mUbos;
+	int mSlot = 0; /* Buffer of the last upload */
+	FenceRing mFences;
+};
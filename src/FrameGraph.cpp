@@ -0,0 +1,156 @@
+#include "FrameGraph.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+namespace {
+
+double now()
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+FrameGraph::FrameGraph(TaskPool* pool)
+{
+	mPool = pool;
+}
+
+void FrameGraph::addStage(const std::string& name, StageQueue queue, const std::vector<std::string>& reads,
+	const std::vector<std::string>& writes, std::function<void()> run)
+{
+	std::unique_ptr<Stage> stage(new Stage());
+	stage->name = name;
+	stage->queue = queue;
+	stage->reads = reads;
+	stage->writes = writes;
+	stage->run = run;
+	mStages.push_back(std::move(stage));
+}
+
+void FrameGraph::compile()
+{
+	std::map<std::string, int> lastWriter;
+	std::map<std::string, std::vector<int>> readersSinceWrite;
+	for (int i = 0; i < int(mStages.size()); ++i) {
+		Stage& stage = *mStages[i];
+		stage.dependencies.clear();
+		auto dependOn = [&](int other) {
+			if (std::find(stage.dependencies.begin(), stage.dependencies.end(), other) == stage.dependencies.end())
+				stage.dependencies.push_back(other);
+		};
+
+		for (auto& resource : stage.reads) {
+			auto writer = lastWriter.find(resource);
+			if (writer != lastWriter.end()) dependOn(writer->second);
+			readersSinceWrite[resource].push_back(i);
+		}
+		for (auto& resource : stage.writes) {
+			auto writer = lastWriter.find(resource);
+			if (writer != lastWriter.end()) dependOn(writer->second);
+			for (int reader : readersSinceWrite[resource])
+				if (reader != i) dependOn(reader);
+			readersSinceWrite[resource].clear();
+			lastWriter[resource] = i;
+		}
+	}
+
+	for (auto& stage : mStages) stage->dependents.clear();
+	for (int i = 0; i < int(mStages.size()); ++i)
+		for (int dependency : mStages[i]->dependencies)
+			mStages[dependency]->dependents.push_back(i);
+}
+
+void FrameGraph::execute()
+{
+	double frameStart = now();
+	for (auto& stage : mStages) {
+		stage->remaining = int(stage->dependencies.size());
+		stage->previousGpuStage = -1;
+	}
+	for (int i = 0; i < int(mStages.size()); ++i)
+		if (mStages[i]->queue == CpuStage && mStages[i]->dependencies.empty())
+			mPool->submit(std::bind(&FrameGraph::runStage, this, i), &mCpuStages);
+
+	// GPU stages in whatever order their dependencies allow. While none is
+	// ready, the main thread helps out with CPU stages.
+	std::vector<int> gpuStages;
+	for (int i = 0; i < int(mStages.size()); ++i)
+		if (mStages[i]->queue == GpuStage) gpuStages.push_back(i);
+	int previous = -1;
+	while (!gpuStages.empty()) {
+		auto ready = gpuStages.end();
+		mPool->waitUntil([&] {
+			ready = std::find_if(gpuStages.begin(), gpuStages.end(), [&](int i) { return mStages[i]->remaining == 0; });
+			return ready != gpuStages.end();
+		});
+		int index = *ready;
+		gpuStages.erase(ready);
+		mStages[index]->previousGpuStage = previous;
+		previous = index;
+		runStage(index);
+	}
+	mPool->wait(mCpuStages);
+
+	profile(frameStart);
+}
+
+void FrameGraph::runStage(int index)
+{
+	Stage& stage = *mStages[index];
+	stage.start = now();
+	stage.run();
+	stage.end = now();
+	finishStage(index);
+}
+
+void FrameGraph::finishStage(int index)
+{
+	Stage& stage = *mStages[index];
+	for (int dependent : stage.dependents) {
+		if (--mStages[dependent]->remaining == 0 && mStages[dependent]->queue == CpuStage)
+			mPool->submit(std::bind(&FrameGraph::runStage, this, dependent), &mCpuStages);
+	}
+}
+
+void FrameGraph::profile(double frameStart)
+{
+	if (mStages.empty()) return;
+
+	// Walk back from the stage that finished last, always to the predecessor
+	// that finished last, which is the one that held the stage back. GPU
+	// stages also wait for the main thread to finish the GPU stage before
+	// them, whether or not they depend on it.
+	int last = 0;
+	double frameEnd = frameStart;
+	mSerialTime = 0.0f;
+	for (int i = 0; i < int(mStages.size()); ++i) {
+		mSerialTime += float(mStages[i]->end - mStages[i]->start);
+		if (mStages[i]->end > mStages[last]->end) last = i;
+		frameEnd = std::max(frameEnd, mStages[i]->end);
+	}
+
+	std::vector<int> path;
+	for (int i = last; i != -1;) {
+		path.push_back(i);
+		std::vector<int> predecessors = mStages[i]->dependencies;
+		if (mStages[i]->previousGpuStage != -1) predecessors.push_back(mStages[i]->previousGpuStage);
+		int gate = -1;
+		for (int predecessor : predecessors)
+			if (gate == -1 || mStages[predecessor]->end > mStages[gate]->end) gate = predecessor;
+		i = gate;
+	}
+
+	std::ostringstream text;
+	for (auto it = path.rbegin(); it != path.rend(); ++it) {
+		const Stage& stage = *mStages[*it];
+		if (it != path.rbegin()) text << " > ";
+		text << stage.name << " " << std::fixed << std::setprecision(2) << stage.end - stage.start;
+	}
+	mCriticalPath = text.str();
+	mCriticalPathTime = float(frameEnd - frameStart);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "TaskPool.h"
+#include <string>
+
+// Where a stage runs. CPU stages run on the task pool and must not touch GL,
+// GPU stages submit GL work and run on the main thread.
+enum StageQueue{CpuStage, GpuStage};
+
+// The work of one frame as stages that declare the resources they read and
+// write. A stage depends on the last earlier stage that wrote one of its
+// resources, and writers also wait for earlier readers. Independent CPU
+// stages run on the pool while the main thread submits the GPU stages.
+class FrameGraph {
+public:
+	FrameGraph(TaskPool* pool);
+
+	void addStage(const std::string& name, StageQueue queue, const std::vector<std::string>& reads,
+		const std::vector<std::string>& writes, std::function<void()> run);
+	// Resolves the dependencies, call after the last addStage
+	void compile();
+	void execute();
+
+	// Profile of the last frame, exposed for the params panel
+	std::string mCriticalPath; /* Stages that gated the end of the frame, in order */
+	float mCriticalPathTime = 0.0f; /* Milliseconds from the first stage start to the last stage end */
+	float mSerialTime = 0.0f; /* Sum of all stage times, what running them one by one would cost */
+
+private:
+	struct Stage {
+		std::string name;
+		StageQueue queue;
+		std::vector<std::string> reads, writes;
+		std::function<void()> run;
+		std::vector<int> dependencies, dependents;
+		std::atomic<int> remaining{ 0 };
+		int previousGpuStage = -1; /* GPU stage the main thread ran before this one in the last frame */
+		double start = 0.0, end = 0.0;
+	};
+
+	void runStage(int index);
+	void finishStage(int index);
+	void profile(double frameStart);
+
+	TaskPool* mPool;
+	std::vector<std::unique_ptr<Stage>> mStages;
+	TaskGroup mCpuStages;
+};
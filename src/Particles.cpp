@@ -1,89 +1,284 @@
 #include "Particles.h"
 #include "cinder/Rand.h"
+#include "cinder/Log.h"
+#include "SignedDistanceField.h"
 #include <algorithm>
+#include <limits>
 
-bool ForceField::selectionLock = false;
-
-ParticleManager::ParticleManager(CameraPersp* cam)
+ParticleManager::ParticleManager(CameraPersp* cam) : mPicking(cam)
 {
 	mCam = cam;
+	mSystems.reserve(MAX_PARTICLE_SYSTEMS);
+	mSystems.push_back(ParticleSystemDesc());
 	loadShaders();
 	loadBuffers();
-	getWindow()->getApp()->getSignalUpdate().connect(std::bind(&ParticleManager::updateUniforms, this));
-	getWindow()->getApp()->getSignalUpdate().connect(std::bind(&ParticleManager::updateParticles, this));
+	// One picking dispatcher for all fields, instead of a handler per field
+	getWindow()->getSignalMouseDown().connect(std::bind(&PickingService::mouseDown, &mPicking, std::placeholders::_1));
+	getWindow()->getSignalMouseDrag().connect(std::bind(&PickingService::mouseDrag, &mPicking, std::placeholders::_1));
+	getWindow()->getSignalPostDraw().connect(std::bind(&ParticleManager::drawForceFields, this));
+}
+
+ParticleManager::~ParticleManager()
+{
+	{
+		std::lock_guard<std::mutex> lock(mCompileMutex);
+		mStopCompiling = true;
+	}
+	mCompileRequested.notify_all();
+	if (mCompileThread.joinable())
+		mCompileThread.join();
 }
 
 void ParticleManager::updateParticles()
 {
-	// This equation just reliably swaps all concerned buffers
-	mActiveBuffer = 1 - mActiveBuffer;
+	// Read the current slot and write the next one in the ring
+	int input = mCurrentSlot;
+	int output = (mCurrentSlot + 1) % getBufferDepth();
+	mCurrentSlot = output;
 
 	gl::ScopedGlslProg	glslScope(mPUpdateProgRef);
 	// We use this vao for input to the Glsl, while using the opposite
 	// for the TransformFeedbackObj.
-	gl::ScopedVao		vaoScope(mPVao[mActiveBuffer]);
+	gl::ScopedVao		vaoScope(mPVao[input]);
 	// Because we're not using a fragment shader, we need to
 	// stop the rasterizer. This will make sure that OpenGL won't
 	// move to the rasterization stage.
 	gl::ScopedState		stateScope(GL_RASTERIZER_DISCARD, true);
 
-	mPUpdateProgRef->uniform("Time", getElapsedFrames() / 60.0f);
+	// Every update covers one timestep of simulated time, however long the frame took
+	mSimulationTime += mTimestep;
+	mPUpdateProgRef->uniform("Time", getSimulationTime());
+	if (mFieldStore) mFieldStore->bind();
+	for (size_t i = 0; i < mMeshObstacleSdfs.size(); ++i)
+		mMeshObstacleSdfs[i]->bind(uint8_t(i));
+	mPUpdateProgRef->uniform("H", mTimestep);
+	mPUpdateProgRef->uniform("FrameIndex", int(getElapsedFrames()));
+	mPUpdateProgRef->uniform("LodEnabled", mLodEnabled);
+	mPUpdateProgRef->uniform("CameraPosition", mCam->getEyePoint());
+	mPUpdateProgRef->uniform("ViewProjection", mCam->getProjectionMatrix() * mCam->getViewMatrix());
+	mPUpdateProgRef->uniform("LodNearDistance", mLodNearDistance);
+	mPUpdateProgRef->uniform("LodInterval", std::max(mLodInterval, 1));
+	mPUpdateProgRef->uniform("MaxLodTimestep", mMaxLodTimestep);
+
+	// Hand this frame's spawned particles to the shader
+	SpawnBatch spawnBatch;
+	if (mSpawnRing) {
+		spawnBatch = mSpawnRing->flush();
+		spawnBatch.count = std::min(spawnBatch.count, mSystems[mSpawnSystem].count);
+		mSpawnRing->getTexture()->bindTexture(MAX_MESH_OBSTACLES);
+	}
+	mPUpdateProgRef->uniform("SpawnSystem", mSpawnSystem);
+	mPUpdateProgRef->uniform("SpawnCursor", mSpawnCursor);
+	mPUpdateProgRef->uniform("SpawnCount", spawnBatch.count);
+	mPUpdateProgRef->uniform("SpawnOffset", spawnBatch.offset);
 
 	// Opposite TransformFeedbackObj to catch the calculated values
 	// In the opposite buffer
-	mPFeedback[1 - mActiveBuffer]->bind();
-
+	mPFeedback[output]->bind();
 
-	gl::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, mPPositions[1 - mActiveBuffer]);
-	gl::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 1, mPVelocities[1 - mActiveBuffer]);
-	gl::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 2, mPStartTimes[1 - mActiveBuffer]);
 	// We begin Transform Feedback, using the same primitive that
 	// we're "drawing". Using points for the particle system.
+	// All systems are updated in one pass, the shader passes the inactive
+	// particles of each system through unchanged.
 	gl::beginTransformFeedback(GL_POINTS);
 	gl::drawArrays(GL_POINTS, 0, mNumParticles);
 	gl::endTransformFeedback();
+	// The CPU only ever reads the slots, so only writes are fenced. The input
+	// slot stays released for readState while this update runs.
+	mSlotFences->fence(output);
+	for (size_t i = 0; i < mMeshObstacleSdfs.size(); ++i)
+		mMeshObstacleSdfs[i]->unbind(uint8_t(i));
+
+	if (mSpawnRing) {
+		mSpawnRing->getTexture()->unbindTexture(MAX_MESH_OBSTACLES);
+		mSpawnRing->fence();
+		mSpawnCursor = (mSpawnCursor + spawnBatch.count) % mSystems[mSpawnSystem].count;
+	}
+
+	if (mSortMode != NoSort && getElapsedFrames() % std::max(mSortInterval, 1) == 0)
+		sortParticles();
+}
+
+void ParticleManager::sortParticles()
+{
+	if (!mRadixSort) {
+		if (!RadixSort::isSupported()) return;
+		mRadixSort.reset(new RadixSort());
+		mSortKeysProgRef = gl::GlslProg::create(gl::GlslProg::Format().compute(loadAsset("sortKeys.comp")));
+	}
+	if (!mSortKeys || mSortKeys->getSize() < mNumParticles * sizeof(GLuint)) {
+		mSortKeys = gl::BufferObj::create(GL_SHADER_STORAGE_BUFFER, mNumParticles * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+		mSortValues = gl::BufferObj::create(GL_SHADER_STORAGE_BUFFER, mNumParticles * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+		mSortScratch = gl::BufferObj::create(GL_SHADER_STORAGE_BUFFER, mNumParticles * sizeof(vec3), nullptr, GL_DYNAMIC_COPY);
+	}
+
+	// The buffers the update pass just wrote, which are drawn next
+	int current = mCurrentSlot;
+	// Enough low bits for the 20 bit depth or Morton code and the slot of the largest system
+	int slotBits = 20;
+	for (auto& system : mSystems) {
+		while ((int64_t(1) << slotBits) < system.count) ++slotBits;
+	}
+	{
+		gl::ScopedGlslProg progScope(mSortKeysProgRef);
+		for (size_t s = 0; s < mSystems.size(); ++s) {
+			mSortKeysProgRef->uniform("SystemFirst[" + to_string(s) + "]", mSystems[s].first);
+			mSortKeysProgRef->uniform("SystemActiveCount[" + to_string(s) + "]", getActiveCount(mSystems[s]));
+		}
+		mSortKeysProgRef->uniform("Count", mNumParticles);
+		mSortKeysProgRef->uniform("SortMode", mSortMode);
+		mSortKeysProgRef->uniform("SpawnSystem", mSpawnSystem);
+		mSortKeysProgRef->uniform("SlotBits", slotBits);
+		mSortKeysProgRef->uniform("CameraPosition", mCam->getEyePoint());
+		mSortKeysProgRef->uniform("ViewDirection", mCam->getViewDirection());
+		mSortKeysProgRef->uniform("FarClip", mCam->getFarClip());
+		mSortKeysProgRef->uniform("BoundsMin", mSortBounds.getMin());
+		mSortKeysProgRef->uniform("BoundsSize", mSortBounds.getSize());
+		gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, mSortKeys);
+		gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, mSortValues);
+		gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, mPPositions[current]);
+		gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, mPSystemIndices);
+		gl::dispatchCompute(GLuint((mNumParticles + RadixSort::BLOCK_SIZE - 1) / RadixSort::BLOCK_SIZE));
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	}
+
+	// 4 bits of system index above the inactive bit and the low bits, only as
+	// many passes as the largest system needs
+	mRadixSort->sort(mSortKeys, mSortValues, mNumParticles, slotBits + 5);
+
+	// Move every attribute along. The system indices stay as they are, since
+	// every system keeps its range. The other ping-pong side is overwritten
+	// by the next update anyway.
+	std::pair<gl::VboRef, int> attributes[] = {
+		{ mPPositions[current], 3 }, { mPVelocities[current], 3 }, { mPStartTimes[current], 1 },
+		{ mPStepStates[current], 2 }, { mPInitPosition, 3 }, { mPInitVelocity, 3 },
+	};
+	for (auto& attribute : attributes) {
+		mRadixSort->gather(mSortValues, attribute.first, mSortScratch, mNumParticles, attribute.second);
+		copyBuffer(mSortScratch, attribute.first, mNumParticles * attribute.second * sizeof(float));
+	}
+	glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+	mSlotFences->fence(current);
+}
+
+namespace {
+
+template<typename T>
+void readBuffer(const gl::VboRef& buffer, std::vector<T>& data, size_t count)
+{
+	data.resize(count);
+	gl::ScopedBuffer scopeBuffer(GL_ARRAY_BUFFER, buffer->getId());
+	glGetBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(T), data.data());
+}
+
+}
+
+void ParticleManager::setBufferDepth(int depth)
+{
+	mBufferDepth = glm::clamp(depth, 2, 4);
+	if (mBufferDepth != getBufferDepth()) loadBuffers();
+}
+
+bool ParticleManager::readState(std::vector<vec3>* positions, std::vector<vec3>* velocities, int* age)
+{
+	// Newest first, back to the oldest slot. That one is only overwritten by
+	// the next update, after the copy below has completed.
+	for (int k = 0; k < getBufferDepth(); ++k) {
+		int slot = (mCurrentSlot - k + getBufferDepth()) % getBufferDepth();
+		if (!mSlotFences->isReleased(slot)) continue;
+		if (positions) readBuffer(mPPositions[slot], *positions, mNumParticles);
+		if (velocities) readBuffer(mPVelocities[slot], *velocities, mNumParticles);
+		if (age) *age = k;
+		return true;
+	}
+	return false;
 }
 
 void ParticleManager::loadBuffers()
 {
-	Rand rand;
-	std::vector<vec3> positions(mNumParticles, vec3(0.0f));
-	for (auto positionsIt = positions.begin(); positionsIt != positions.end(); ++positionsIt) {
-		// Creating a starting velocity
-		*positionsIt = vec3(0, 0, 0) +rand.randVec3();
+	// Particles of the systems that already exist keep their state. Systems are
+	// only ever appended, so their ranges stay where they are, and the old
+	// buffers are copied into the front of the new ones on the GPU.
+	int oldParticles = mSlotFences ? mNumParticles : 0;
+	gl::VboRef oldPositions, oldVelocities, oldStartTimes, oldStepStates, oldInitPositions, oldInitVelocities;
+	if (oldParticles > 0) {
+		oldPositions = mPPositions[mCurrentSlot];
+		oldVelocities = mPVelocities[mCurrentSlot];
+		oldStartTimes = mPStartTimes[mCurrentSlot];
+		oldStepStates = mPStepStates[mCurrentSlot];
+		oldInitPositions = mPInitPosition;
+		oldInitVelocities = mPInitVelocity;
 	}
-	mPInitPosition = ci::gl::Vbo::create(GL_ARRAY_BUFFER, positions.size() * sizeof(vec3), positions.data(), GL_STATIC_DRAW);
 
-	mPPositions[0] = ci::gl::Vbo::create(GL_ARRAY_BUFFER, positions.size() * sizeof(vec3), positions.data(), GL_STATIC_DRAW);
-	mPPositions[1] = ci::gl::Vbo::create(GL_ARRAY_BUFFER, positions.size() * sizeof(vec3), nullptr, GL_STATIC_DRAW);
-	std::vector<vec3> normals = std::move(positions);
-	for (auto normalIt = normals.begin(); normalIt != normals.end(); ++normalIt) {
-		// Creating a starting velocity
-		*normalIt = vec3(-3, 2, 0);
+	// Lay the systems out back to back in the shared buffers, keeping the
+	// share of active particles the governor asked for
+	float activeFraction = mNumParticles > 0 ? float(mActiveParticles) / mNumParticles : 1.0f;
+	mNumParticles = 0;
+	for (auto& system : mSystems) {
+		system.first = mNumParticles;
+		mNumParticles += system.count;
 	}
+	mActiveParticles = std::max(1, int(mNumParticles * activeFraction));
 
-	// Create the Velocity Buffer using the newly buffered velocities
-	mPVelocities[0] = ci::gl::Vbo::create(GL_ARRAY_BUFFER, normals.size() * sizeof(vec3), normals.data(), GL_STATIC_DRAW);
-	// Create another Velocity Buffer that is null, for ping-ponging
-	mPVelocities[1] = ci::gl::Vbo::create(GL_ARRAY_BUFFER, normals.size() * sizeof(vec3), nullptr, GL_STATIC_DRAW);
+	Rand rand;
+	std::vector<vec3> positions(mNumParticles, vec3(0.0f));
+	std::vector<vec3> normals(mNumParticles, vec3(0.0f));
+	vector<GLfloat> timeData(mNumParticles, 0.0f);
+	vector<GLint> systemIndices(mNumParticles, 0);
+	for (size_t s = 0; s < mSystems.size(); ++s) {
+		const ParticleSystemDesc& system = mSystems[s];
+		// Stagger the start times over one lifetime, so the emitter streams evenly
+		float time = 0.0f;
+		float rate = system.lifetime / system.count;
+		for (int i = system.first; i < system.first + system.count; ++i) {
+			positions[i] = system.emitterPosition + rand.randVec3() * system.emitterRadius;
+			// Creating a starting velocity
+			normals[i] = system.initialVelocity;
+			// Particles of systems that don't recycle start out dead
+			timeData[i] = system.recycle ? time : -1.0f;
+			time += rate;
+			systemIndices[i] = GLint(s);
+		}
+	}
+	// Awake, and integrated up to now
+	vector<vec2> stepData(mNumParticles, vec2(0.0f, getSimulationTime()));
+
+	mPInitPosition = ci::gl::Vbo::create(GL_ARRAY_BUFFER, positions.size() * sizeof(vec3), positions.data(), GL_STATIC_DRAW);
 	// Create an initial velocity buffer, so that you can reset a particle's velocity after it's dead
 	mPInitVelocity = ci::gl::Vbo::create(GL_ARRAY_BUFFER, normals.size() * sizeof(vec3), normals.data(), GL_STATIC_DRAW);
 
-	// Create time data for the initialization of the particles
-	vector<GLfloat> timeData;
-	float time = 0.0f;
-	float rate = 0.001f;
-	for (int i = 0; i < mNumParticles; i++) {
-		timeData.push_back(time);
-		time += rate;
+	mSlotFences.reset(new FenceRing("ParticleManager", mBufferDepth));
+	mCurrentSlot = 0;
+	mPVao.resize(mBufferDepth);
+	mPFeedback.resize(mBufferDepth);
+	mPPositions.resize(mBufferDepth);
+	mPVelocities.resize(mBufferDepth);
+	mPStartTimes.resize(mBufferDepth);
+	mPStepStates.resize(mBufferDepth);
+	for (int i = 0; i < mBufferDepth; i++) {
+		mPPositions[i] = ci::gl::Vbo::create(GL_ARRAY_BUFFER, positions.size() * sizeof(vec3), positions.data(), GL_STATIC_DRAW);
+		mPVelocities[i] = ci::gl::Vbo::create(GL_ARRAY_BUFFER, normals.size() * sizeof(vec3), normals.data(), GL_STATIC_DRAW);
+		// The start times let us reset the particle after it's dead
+		mPStartTimes[i] = ci::gl::Vbo::create(GL_ARRAY_BUFFER, timeData.size() * sizeof(float), timeData.data(), GL_DYNAMIC_COPY);
+		// Rest frames and the time each particle was last stepped to
+		mPStepStates[i] = ci::gl::Vbo::create(GL_ARRAY_BUFFER, stepData.size() * sizeof(vec2), stepData.data(), GL_DYNAMIC_COPY);
 	}
 
-	// Create the StartTime Buffer, so that we can reset the particle after it's dead
-	mPStartTimes[0] = ci::gl::Vbo::create(GL_ARRAY_BUFFER, timeData.size() * sizeof(float), timeData.data(), GL_DYNAMIC_COPY);
-	// Create the StartTime ping-pong buffer
-	mPStartTimes[1] = ci::gl::Vbo::create(GL_ARRAY_BUFFER, mNumParticles * sizeof(float), nullptr, GL_DYNAMIC_COPY);
+	if (oldParticles > 0) {
+		copyBuffer(oldInitPositions, mPInitPosition, oldParticles * sizeof(vec3));
+		copyBuffer(oldInitVelocities, mPInitVelocity, oldParticles * sizeof(vec3));
+		for (int i = 0; i < mBufferDepth; i++) {
+			copyBuffer(oldPositions, mPPositions[i], oldParticles * sizeof(vec3));
+			copyBuffer(oldVelocities, mPVelocities[i], oldParticles * sizeof(vec3));
+			copyBuffer(oldStartTimes, mPStartTimes[i], oldParticles * sizeof(float));
+			copyBuffer(oldStepStates, mPStepStates[i], oldParticles * sizeof(vec2));
+		}
+	}
 
-	for (int i = 0; i < 2; i++) {
+	// The system each particle belongs to never changes, one buffer is enough
+	mPSystemIndices = ci::gl::Vbo::create(GL_ARRAY_BUFFER, systemIndices.size() * sizeof(GLint), systemIndices.data(), GL_STATIC_DRAW);
+
+	for (int i = 0; i < mBufferDepth; i++) {
 		// Initialize the Vao's holding the info for each buffer
 		mPVao[i] = ci::gl::Vao::create();
 
@@ -109,6 +304,13 @@ void ParticleManager::loadBuffers()
 		ci::gl::vertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, 0);
 		ci::gl::enableVertexAttribArray(4);
 
+		mPStepStates[i]->bind();
+		ci::gl::vertexAttribPointer(5, 2, GL_FLOAT, GL_FALSE, 0, 0);
+		ci::gl::enableVertexAttribArray(5);
+
+		mPSystemIndices->bind();
+		ci::gl::vertexAttribIPointer(6, 1, GL_INT, 0, 0);
+		ci::gl::enableVertexAttribArray(6);
 
 		// Create a TransformFeedbackObj, which is similar to Vao
 		// It's used to capture the output of a glsl and uses the
@@ -121,77 +323,274 @@ void ParticleManager::loadBuffers()
 		gl::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, mPPositions[i]);
 		gl::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 1, mPVelocities[i]);
 		gl::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 2, mPStartTimes[i]);
+		gl::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 3, mPStepStates[i]);
 		mPFeedback[i]->unbind();
 	}
 }
 
 void ParticleManager::draw()
 {
-	gl::ScopedVao			vaoScope(mPVao[1 - mActiveBuffer]);
+	for (int resolution = FullResolution; resolution <= QuarterResolution; ++resolution) {
+		bool used = false;
+		for (auto& system : mSystems)
+			used = used || getRenderResolution(system) == resolution;
+		if (!used) continue;
+
+		if (resolution == FullResolution) {
+			gl::ScopedBlend blendScope(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			drawParticles(1.0f, resolution);
+		}
+		else {
+			drawReducedResolution(resolution);
+		}
+	}
+}
+
+namespace {
+
+// Internal format matching the depth buffer of the bound draw framebuffer
+GLint queryDepthFormat()
+{
+	GLint depthBits = 0, stencilBits = 0, type = GL_NONE;
+	glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, GL_DEPTH, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &depthBits);
+	glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, GL_STENCIL, GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencilBits);
+	glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, GL_DEPTH, GL_FRAMEBUFFER_ATTACHMENT_COMPONENT_TYPE, &type);
+	if (stencilBits > 0) return type == GL_FLOAT ? GL_DEPTH32F_STENCIL8 : GL_DEPTH24_STENCIL8;
+	if (type == GL_FLOAT) return GL_DEPTH_COMPONENT32F;
+	if (depthBits == 16) return GL_DEPTH_COMPONENT16;
+	return depthBits == 32 ? GL_DEPTH_COMPONENT32 : GL_DEPTH_COMPONENT24;
+}
+
+}
+
+void ParticleManager::drawReducedResolution(int resolution)
+{
+	// Queried while the window's framebuffer is bound, the depth attachments
+	// below take its exact format so the depth blits are valid
+	if (mDepthFormat == GL_NONE) mDepthFormat = queryDepthFormat();
+	auto depthFormat = gl::Texture::Format().internalFormat(mDepthFormat);
+
+	ivec2 size = toPixels(getWindowSize());
+	ivec2 lowSize = glm::max(size / (resolution == HalfResolution ? 2 : 4), ivec2(1));
+	gl::FboRef& particleFbo = mParticleFbos[resolution];
+	if (!particleFbo || particleFbo->getSize() != lowSize)
+		particleFbo = gl::Fbo::create(lowSize.x, lowSize.y, gl::Fbo::Format().depthTexture(depthFormat));
+	if (!mSceneDepthFbo || mSceneDepthFbo->getSize() != size)
+		mSceneDepthFbo = gl::Fbo::create(size.x, size.y, gl::Fbo::Format().disableColor().depthTexture(depthFormat));
+
+	// Copy the scene depth, once at full resolution for the upsample and once
+	// point sampled into the low resolution target to test the particles against
+	mSceneDepthFbo->blitFromScreen(Area(ivec2(0), size), Area(ivec2(0), size), GL_NEAREST, GL_DEPTH_BUFFER_BIT);
+	particleFbo->blitFromScreen(Area(ivec2(0), size), Area(ivec2(0), lowSize), GL_NEAREST, GL_DEPTH_BUFFER_BIT);
+
+	{
+		gl::ScopedFramebuffer fboScope(particleFbo);
+		gl::ScopedViewport viewportScope(ivec2(0), lowSize);
+		gl::clear(ColorA(0, 0, 0, 0), false);
+		gl::ScopedDepthTest depthScope(true);
+		gl::ScopedDepthWrite depthWriteScope(false);
+		// Accumulate premultiplied color, so the layer can be composited with one blend
+		gl::ScopedBlend blendScope(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+		drawParticles(float(lowSize.x) / size.x, resolution);
+	}
+
+	gl::ScopedMatrices matricesScope;
+	gl::setMatricesWindow(getWindowSize());
+	gl::ScopedGlslProg glslScope(mCompositeProgRef);
+	gl::ScopedTextureBind colorScope(mParticleFbos[resolution]->getColorTexture(), 0);
+	gl::ScopedTextureBind depthScope(mParticleFbos[resolution]->getDepthTexture(), 1);
+	gl::ScopedTextureBind sceneScope(mSceneDepthFbo->getDepthTexture(), 2);
+	gl::ScopedBlend blendScope(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	mCompositeProgRef->uniform("LowResSize", lowSize);
+	gl::drawSolidRect(Rectf(vec2(0), vec2(getWindowSize())));
+}
+
+void ParticleManager::drawParticles(float pointScale, int resolution)
+{
+	gl::ScopedVao			vaoScope(mPVao[mCurrentSlot]);
 	gl::ScopedGlslProg		glslScope(mPRenderProgRef);
 	gl::ScopedState			stateScope(GL_PROGRAM_POINT_SIZE, true);
-	gl::ScopedBlend			blendScope(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	mPRenderProgRef->bind();
+	mPRenderProgRef->uniform("PointSize", mPointSize * pointScale);
 	gl::setDefaultShaderVars();
-	gl::drawArrays(GL_POINTS, 0, mNumParticles);
+
+	// One multi-draw over the active part of every system drawn at this resolution
+	std::vector<GLint> firsts;
+	std::vector<GLsizei> counts;
+	for (auto& system : mSystems) {
+		firsts.push_back(system.first);
+		counts.push_back(getRenderResolution(system) == resolution ? getActiveCount(system) : 0);
+	}
+	glMultiDrawArrays(GL_POINTS, firsts.data(), counts.data(), GLsizei(mSystems.size()));
+}
+
+int ParticleManager::addParticleSystem(const ParticleSystemDesc& desc)
+{
+	if (int(mSystems.size()) == MAX_PARTICLE_SYSTEMS) return -1;
+	// Larger systems would overflow the slot bits of the sort keys
+	if (desc.count > MAX_SYSTEM_PARTICLES) {
+		CI_LOG_E("Particle systems are limited to " << MAX_SYSTEM_PARTICLES << " particles, got " << desc.count);
+		return -1;
+	}
+	mSystems.push_back(desc);
+	mSystems.back().count = std::max(desc.count, 1);
+	loadBuffers();
+	return int(mSystems.size()) - 1;
+}
+
+int ParticleManager::createSpawnSystem(const ParticleSystemDesc& desc, int capacityPerFrame)
+{
+	if (mSpawnSystem != -1) return mSpawnSystem;
+	ParticleSystemDesc spawnDesc = desc;
+	spawnDesc.recycle = false;
+	mSpawnSystem = addParticleSystem(spawnDesc);
+	if (mSpawnSystem != -1) {
+		mSpawnCursor = 0;
+		mSpawnRing.reset(new SpawnRing(capacityPerFrame));
+	}
+	return mSpawnSystem;
+}
+
+bool ParticleManager::spawn(vec3 position, vec3 velocity)
+{
+	return mSpawnRing && mSpawnRing->push(position, velocity);
+}
+
+int ParticleManager::getActiveCount(const ParticleSystemDesc& system) const
+{
+	// Spawned particles were asked for explicitly, they are never culled
+	if (!system.recycle) return system.count;
+	// The active share is the same for every system
+	return std::max(1, int(int64_t(system.count) * mActiveParticles / mNumParticles));
+}
+
+void ParticleManager::drawForceFields()
+{
+	if (!mForceFieldsVisible) return;
+
+	if (mGizmosDirty) {
+		mSphereGizmos.data.clear();
+		mCubeGizmos.data.clear();
+		for (auto& ff : forceFields) {
+			if (ff->type == CObstacle) {
+				auto cff = (CuboidForceField*)(ff.get());
+				mCubeGizmos.data.push_back({ cff->position, cff->size, cff->getColor() });
+			}
+			else if (ff->type != MObstacle) {
+				auto sff = (SphericalForceField*)(ff.get());
+				mSphereGizmos.data.push_back({ sff->position, vec3(sff->radius), sff->getColor() });
+			}
+		}
+		uploadGizmos(mSphereGizmos, geom::Sphere().radius(1.0f));
+		uploadGizmos(mCubeGizmos, geom::Cube().size(vec3(1.0f)));
+		mGizmosDirty = false;
+	}
+
+	if (!mSphereGizmos.data.empty())
+		mSphereGizmos.batch->drawInstanced(int(mSphereGizmos.data.size()));
+	if (!mCubeGizmos.data.empty())
+		mCubeGizmos.batch->drawInstanced(int(mCubeGizmos.data.size()));
+
+	for (auto& ff : forceFields) {
+		if (ff->type == MObstacle) ((MeshObstacle*)(ff.get()))->drawMesh();
+	}
+	if (mPicking.getSelected()) mPicking.getSelected()->drawHandles();
+}
+
+void ParticleManager::uploadGizmos(GizmoBatch& gizmos, const geom::Source& shape)
+{
+	if (gizmos.data.size() > gizmos.capacity) {
+		// Grow geometrically, the batch has to be rebuilt around the new buffer
+		gizmos.capacity = std::max<size_t>(16, gizmos.capacity * 2);
+		while (gizmos.capacity < gizmos.data.size()) gizmos.capacity *= 2;
+		gizmos.instances = gl::Vbo::create(GL_ARRAY_BUFFER, gizmos.capacity * sizeof(GizmoInstance), nullptr, GL_DYNAMIC_DRAW);
+
+		geom::BufferLayout layout;
+		layout.append(geom::Attrib::CUSTOM_0, 3, sizeof(GizmoInstance), offsetof(GizmoInstance, position), 1);
+		layout.append(geom::Attrib::CUSTOM_1, 3, sizeof(GizmoInstance), offsetof(GizmoInstance, scale), 1);
+		layout.append(geom::Attrib::CUSTOM_2, 4, sizeof(GizmoInstance), offsetof(GizmoInstance, color), 1);
+		gl::VboMeshRef mesh = gl::VboMesh::create(shape);
+		mesh->appendVbo(layout, gizmos.instances);
+		gizmos.batch = gl::Batch::create(mesh, mGizmoProgRef, {
+			{ geom::Attrib::CUSTOM_0, "InstancePosition" },
+			{ geom::Attrib::CUSTOM_1, "InstanceScale" },
+			{ geom::Attrib::CUSTOM_2, "InstanceColor" } });
+	}
+	if (!gizmos.data.empty())
+		gizmos.instances->bufferSubData(0, gizmos.data.size() * sizeof(GizmoInstance), gizmos.data.data());
 }
 
 void ParticleManager::addDirectionalForceField(vec3 pos, float radius, vec3 force)
 {
-	forceFields.push_back(make_shared<DirectionForceField>(pos, radius, force, mCam));
-	forceFields.back()->connectSignals();
+	addForceField(make_shared<DirectionForceField>(pos, radius, force));
 }
 
 void ParticleManager::addExpansionForceField(vec3 pos, float radius, float force)
 {
-	forceFields.push_back(make_shared<ExpansionForceField>(pos, radius, force,mCam));
-	forceFields.back()->connectSignals();
+	addForceField(make_shared<ExpansionForceField>(pos, radius, force));
 }
 
 void ParticleManager::addContractionForceField(vec3 pos, float radius, float force)
 {
-	forceFields.push_back(make_shared<ContractionForceField>(pos, radius, force, mCam));
-	forceFields.back()->connectSignals();
+	addForceField(make_shared<ContractionForceField>(pos, radius, force));
 }
 
 void ParticleManager::addCuboidObstacle(vec3 pos, vec3 size)
 {
-	forceFields.push_back(make_shared<CuboidObstacle>(pos, size, mCam));
-	forceFields.back()->connectSignals();
+	addForceField(make_shared<CuboidObstacle>(pos, size));
+}
+
+void ParticleManager::addMeshObstacle(const geom::Source& source, vec3 pos, float scale, quat orientation)
+{
+	addForceField(make_shared<MeshObstacle>(source, pos, scale, orientation));
+}
+
+void ParticleManager::addForceField(shared_ptr<ForceField> ff)
+{
+	forceFields.push_back(ff);
+	mPicking.add(ff.get());
+	mGizmosDirty = true;
+	prewarmFieldMix();
 }
 
 void ParticleManager::deleteForceField()
 {
-	{
-		auto element = find_if(forceFields.begin(), forceFields.end(), [](shared_ptr<ForceField> ff) {
-			return ff->isSelected();
-		});
-		if(element != forceFields.end())forceFields.erase(element);
-	}
+	ForceField* selected = mPicking.getSelected();
+	if (!selected) return;
+
+	auto element = find_if(forceFields.begin(), forceFields.end(), [&](shared_ptr<ForceField> ff) {
+		return ff.get() == selected;
+	});
+	wakeParticles(selected->getBounds());
+	mPicking.remove(selected);
+	forceFields.erase(element);
+	mGizmosDirty = true;
+	prewarmFieldMix();
+}
 
+void ParticleManager::setActiveParticles(int count)
+{
+	// Particles beyond the active prefix keep their last state in the
+	// ping-pong buffers and simply resume once they are active again.
+	mActiveParticles = glm::clamp(count, 1, mNumParticles);
 }
 
 void ParticleManager::setForceFieldVisibility(bool visible)
 {
-	if(visible)
-		for_each(forceFields.begin(), forceFields.end(), [&](shared_ptr<ForceField> ff) {
-			ff->connectSignals();
-		});
-	else
-		for_each(forceFields.begin(), forceFields.end(), [&](shared_ptr<ForceField> ff) {
-		ff->connectionList.clear();
-	});
+	mForceFieldsVisible = visible;
+	mPicking.setEnabled(visible);
 }
 
 
 
-void ParticleManager::loadShaders()
+gl::GlslProgRef ParticleManager::createUpdateProgram(const UpdateVariant* variant)
 {
-	std::vector<std::string> varyings(3);
+	std::vector<std::string> varyings(4);
 	varyings[0] = "Position";
 	varyings[1] = "Velocity";
 	varyings[2] = "StartTime";
+	varyings[3] = "StepState";
 
 	ci::gl::GlslProg::Format updateProgFormat;
 
@@ -201,86 +600,311 @@ void ParticleManager::loadShaders()
 		.attribLocation("VertexPosition", 0)
 		.attribLocation("VertexVelocity", 1)
 		.attribLocation("VertexStartTime", 2)
-		.attribLocation("VertexInitialVelocity", 3);
-	mPUpdateProgRef = ci::gl::GlslProg::create(updateProgFormat);
-	mPUpdateProgRef->uniform("H", 1.0f / 60.0f);
+		.attribLocation("VertexInitialVelocity", 3)
+		.attribLocation("VertexInitialPosition", 4)
+		.attribLocation("VertexStepState", 5)
+		.attribLocation("VertexSystem", 6);
+	if (variant) {
+		updateProgFormat.define("MAX_DIRECTIONAL_FIELDS", to_string(variant->directional))
+			.define("MAX_EXPANSION_FIELDS", to_string(variant->expansion))
+			.define("MAX_CONTRACTION_FIELDS", to_string(variant->contraction))
+			.define("MAX_CUBOID_OBSTACLES", to_string(variant->cuboids))
+			.define("MAX_MESH_OBSTACLES", to_string(variant->meshes))
+			.define("USE_DRAG", variant->drag ? "1" : "0");
+	}
+	// May run on the compile thread, so only per-program state is set here.
+	// The timestep and the rest of the frame's uniforms are set in update().
+	gl::GlslProgRef prog = ci::gl::GlslProg::create(updateProgFormat);
+	FieldStore::attach(prog);
+	for (int i = 0; i < MAX_MESH_OBSTACLES; ++i)
+		prog->uniform("meshObstacleSdfs[" + to_string(i) + "]", i);
+	prog->uniform("SpawnData", MAX_MESH_OBSTACLES);
+	return prog;
+}
+
+namespace {
+
+// Variants are built for 0, 2 or max fields of a type, so a handful of
+// programs covers every scene and adding a field rarely needs a new one
+int bucketFieldCount(int count, int max)
+{
+	if (count <= 0) return 0;
+	if (count <= 2) return std::min(2, max);
+	return max;
+}
+
+}
+
+UpdateVariant ParticleManager::makeVariant(int directional, int expansion, int contraction, int cuboids, int meshes) const
+{
+	UpdateVariant variant;
+	variant.directional = bucketFieldCount(directional, MAX_FIELDS_PER_TYPE);
+	variant.expansion = bucketFieldCount(expansion, MAX_FIELDS_PER_TYPE);
+	variant.contraction = bucketFieldCount(contraction, MAX_FIELDS_PER_TYPE);
+	variant.cuboids = bucketFieldCount(cuboids, MAX_FIELDS_PER_TYPE);
+	variant.meshes = bucketFieldCount(meshes, MAX_MESH_OBSTACLES);
+	for (auto& system : mSystems)
+		variant.drag = variant.drag || system.dragCoefficient != 0.0f;
+	return variant;
+}
+
+void ParticleManager::requestVariant(const UpdateVariant& variant)
+{
+	if (mVariants.count(variant)) return;
+	std::lock_guard<std::mutex> lock(mCompileMutex);
+	auto matches = [&](const UpdateVariant& v) { return !(v < variant) && !(variant < v); };
+	if (std::find_if(mPendingVariants.begin(), mPendingVariants.end(), matches) != mPendingVariants.end()) return;
+	if (std::find_if(mCompiledVariants.begin(), mCompiledVariants.end(),
+		[&](const std::pair<UpdateVariant, gl::GlslProgRef>& c) { return matches(c.first); }) != mCompiledVariants.end()) return;
+	mPendingVariants.push_back(variant);
+	mCompileRequested.notify_one();
+}
+
+void ParticleManager::prewarmVariants(const std::vector<UpdateVariant>& variants)
+{
+	for (auto& variant : variants)
+		requestVariant(makeVariant(variant.directional, variant.expansion, variant.contraction, variant.cuboids, variant.meshes));
+}
+
+void ParticleManager::prewarmFieldMix()
+{
+	// Meshes still baking count already, they join the pack once they are done
+	int counts[5] = {};
+	for (auto& ff : forceFields)
+		++counts[ff->type];
+
+	// The scene as it is, and as it is after adding the next field of any type
+	std::vector<UpdateVariant> variants;
+	for (int added = -1; added < 5; ++added) {
+		UpdateVariant variant;
+		variant.directional = counts[Directional] + (added == Directional);
+		variant.expansion = counts[Expansion] + (added == Expansion);
+		variant.contraction = counts[Contraction] + (added == Contraction);
+		variant.cuboids = counts[CObstacle] + (added == CObstacle);
+		variant.meshes = counts[MObstacle] + (added == MObstacle);
+		variants.push_back(variant);
+	}
+	prewarmVariants(variants);
+}
+
+void ParticleManager::cacheVariant(const UpdateVariant& variant, gl::GlslProgRef prog)
+{
+	CachedVariant& cached = mVariants[variant];
+	cached.prog = prog;
+	cached.lastUsed = getElapsedFrames();
+	if (int(mVariants.size()) <= MAX_CACHED_VARIANTS) return;
+
+	// Drop the least recently used variant, other than the one just added
+	auto oldest = mVariants.end();
+	for (auto it = mVariants.begin(); it != mVariants.end(); ++it) {
+		if (!(it->first < variant) && !(variant < it->first)) continue;
+		if (oldest == mVariants.end() || it->second.lastUsed < oldest->second.lastUsed)
+			oldest = it;
+	}
+	mVariants.erase(oldest);
+}
+
+void ParticleManager::compileLoop(gl::ContextRef context)
+{
+	context->makeCurrent();
+	while (true) {
+		UpdateVariant variant;
+		{
+			std::unique_lock<std::mutex> lock(mCompileMutex);
+			mCompileRequested.wait(lock, [this] { return mStopCompiling || !mPendingVariants.empty(); });
+			if (mStopCompiling) return;
+			variant = mPendingVariants.front();
+		}
+
+		gl::GlslProgRef prog;
+		try {
+			prog = createUpdateProgram(&variant);
+		}
+		catch (const std::exception& e) {
+			// Cached empty, so the generic shader keeps standing in for it
+			CI_LOG_E("Update shader variant failed to build: " << e.what());
+		}
+		// The main context may only use the program once its link has finished
+		glFinish();
+
+		std::lock_guard<std::mutex> lock(mCompileMutex);
+		mPendingVariants.erase(mPendingVariants.begin());
+		mCompiledVariants.emplace_back(variant, prog);
+	}
+}
+
+void ParticleManager::selectUpdateProgram()
+{
+	{
+		std::lock_guard<std::mutex> lock(mCompileMutex);
+		for (auto& compiled : mCompiledVariants)
+			cacheVariant(compiled.first, compiled.second);
+		mCompiledVariants.clear();
+	}
+
+	mPUpdateProgRef = mGenericUpdateProgRef;
+	if (!mUseVariants) return;
+
+	UpdateVariant variant = makeVariant(int(mFieldPack.directional.size()), int(mFieldPack.expansion.size()),
+		int(mFieldPack.contraction.size()), int(mFieldPack.cuboids.size()), int(mFieldPack.meshes.size()));
+	auto it = mVariants.find(variant);
+	if (it != mVariants.end()) {
+		it->second.lastUsed = getElapsedFrames();
+		if (it->second.prog) mPUpdateProgRef = it->second.prog;
+	}
+	else
+		requestVariant(variant);
+}
+
+void ParticleManager::loadShaders()
+{
+	mGenericUpdateProgRef = createUpdateProgram(nullptr);
+	mPUpdateProgRef = mGenericUpdateProgRef;
+	// Variants are linked on a context of their own, which shares objects with this one
+	mCompileThread = std::thread(&ParticleManager::compileLoop, this, gl::Context::create(gl::context()));
+	prewarmFieldMix();
 
 	ci::gl::GlslProg::Format renderProgFormat;
 	renderProgFormat.vertex(loadAsset("renderParticle.vert"))
 		.fragment(loadAsset("renderParticle.frag"))
-		.attribLocation("VertexPosition", 0);
-      //.attribLocation("VertexStartTime", 2);
+		.attribLocation("VertexPosition", 0)
+		// Dead particles are culled on their start time, which has to come from its own buffer
+		.attribLocation("VertexStartTime", 2);
 	mPRenderProgRef = ci::gl::GlslProg::create(renderProgFormat);
+
+	mGizmoProgRef = gl::GlslProg::create(loadAsset("forceField.vert"), loadAsset("forceField.frag"));
+	mCompositeProgRef = gl::GlslProg::create(loadAsset("particleComposite.vert"), loadAsset("particleComposite.frag"));
+	mCompositeProgRef->uniform("ParticleColor", 0);
+	mCompositeProgRef->uniform("ParticleDepth", 1);
+	mCompositeProgRef->uniform("SceneDepth", 2);
 	//mPRenderProgRef->uniform("ParticleLifetime", mParticleLifetime);
-	mPRenderProgRef->uniform("ParticleBounciness", mBounciness);
-	mPUpdateProgRef->uniform("ParticleBounciness", mBounciness);
-	mPUpdateProgRef->uniform("DragCoefficient", mDragCoefficient);
 }
 
-void ParticleManager::updateUniforms()
+void ParticleManager::packFields()
 {
-
-	int directionalForceFields = 0, expansionForceFields = 0, contractionForceFields = 0;
-	int cuboidObstacles = 0;
+	FieldPack& pack = mFieldPack;
+	pack.directional.clear();
+	pack.expansion.clear();
+	pack.contraction.clear();
+	pack.cuboids.clear();
+	pack.meshes.clear();
+	pack.meshSdfs.clear();
 	for_each(forceFields.begin(), forceFields.end(), [&](shared_ptr<ForceField> ff) {
 
+		// Wake sleeping particles around fields that were added or moved
+		AxisAlignedBox bounds = ff->getBounds();
+		if (!ff->synced || bounds.getMin() != ff->syncedBounds.getMin() || bounds.getMax() != ff->syncedBounds.getMax()) {
+			if (ff->synced) {
+				wakeParticles(ff->syncedBounds);
+				mPicking.update(ff.get());
+				mGizmosDirty = true;
+			}
+			wakeParticles(bounds);
+			ff->syncedBounds = bounds;
+			ff->synced = true;
+		}
+
 		switch (ff->type)
 		{
 		case(Directional):
 		{
 			auto *dff = (DirectionForceField*)(ff.get());
-			string loc = "directionalForceFields[" + to_string(directionalForceFields) + "].";
-			mPUpdateProgRef->uniform(loc + "position", dff->position);
-			mPUpdateProgRef->uniform(loc + "radius", dff->radius);
-			mPUpdateProgRef->uniform(loc + "force", dff->force);
-			++directionalForceFields;
+			pack.directional.push_back({ dff->position, dff->radius, dff->force, dff->layers });
 			break;
 		}
 		case(Expansion):
 		{
 			auto *eff = (ExpansionForceField*)(ff.get());
-			string loc = "expansionForceFields[" + to_string(expansionForceFields) + "].";
-			mPUpdateProgRef->uniform(loc + "position", eff->position);
-			mPUpdateProgRef->uniform(loc + "radius", eff->radius);
-			mPUpdateProgRef->uniform(loc + "force", eff->force);
-			++expansionForceFields;
+			pack.expansion.push_back({ eff->position, eff->radius, vec3(eff->force, 0, 0), eff->layers });
 			break;
 		}
 		case(Contraction):
 		{
 			auto *cff = (ContractionForceField*)(ff.get());
-			string loc = "contractionForceFields[" + to_string(contractionForceFields) + "].";
-			mPUpdateProgRef->uniform(loc + "position", cff->position);
-			mPUpdateProgRef->uniform(loc + "radius", cff->radius);
-			mPUpdateProgRef->uniform(loc + "force", cff->force);
-			++contractionForceFields;
+			pack.contraction.push_back({ cff->position, cff->radius, vec3(cff->force, 0, 0), cff->layers });
 			break;
 		}
 		case(CObstacle):
 		{
 			auto cob = (CuboidObstacle*)(ff.get());
-			string loc = "cuboidObstacles[" + to_string(cuboidObstacles) + "].";
-			mPUpdateProgRef->uniform(loc + "pos", cob->position - cob->size/2.f);
-			mPUpdateProgRef->uniform(loc + "size", cob->size);
-			++cuboidObstacles;
+			pack.cuboids.push_back({ cob->position - cob->size / 2.f, 1.0f, cob->size, cob->layers });
+			break;
+		}
+		case(MObstacle):
+		{
+			auto mob = (MeshObstacle*)(ff.get());
+			if (!mob->sdf || int(pack.meshes.size()) == MAX_MESH_OBSTACLES) break;
+			pack.meshes.push_back({ mob->position, mob->scale, mob->localBounds.getExtents(), mob->layers, mat4(toMat3(mob->orientation)) });
+			pack.meshSdfs.push_back(mob->sdf);
 			break;
 		}
 		}
 	});
-	mPUpdateProgRef->uniform("numDirectionalForceFields", directionalForceFields);
-	mPUpdateProgRef->uniform("numExpansionForceFields", expansionForceFields);
-	mPUpdateProgRef->uniform("numContractionForceFields", contractionForceFields);
-	mPUpdateProgRef->uniform("numCuboidObstacles", cuboidObstacles);
-	mPUpdateProgRef->uniform("ParticleBounciness", mBounciness);
-	mPUpdateProgRef->uniform("DragCoefficient", mDragCoefficient);
+
+	// Changed system parameters affect every particle
+	bool systemsChanged = mSystems.size() != mSyncedSystems.size();
+	for (size_t s = 0; !systemsChanged && s < mSystems.size(); ++s) {
+		const ParticleSystemDesc& a = mSystems[s];
+		const ParticleSystemDesc& b = mSyncedSystems[s];
+		systemsChanged = a.lifetime != b.lifetime || a.bounciness != b.bounciness
+			|| a.dragCoefficient != b.dragCoefficient || a.layers != b.layers;
+	}
+	if (systemsChanged) {
+		mSyncedSystems = mSystems;
+		mWakeAll = true;
+	}
+}
+
+void ParticleManager::uploadFields()
+{
+	selectUpdateProgram();
+	// The fields themselves are in the FieldStore, only the textures are bound here
+	mMeshObstacleSdfs = mFieldPack.meshSdfs;
+	// Finished bakes take part from the next pack on, and wake the particles around them
+	for (auto& ff : forceFields) {
+		if (ff->type == MObstacle && ((MeshObstacle*)(ff.get()))->finishBake())
+			wakeParticles(ff->getBounds());
+	}
+
+	for (size_t s = 0; s < mSystems.size(); ++s) {
+		const ParticleSystemDesc& system = mSystems[s];
+		string loc = "particleSystems[" + to_string(s) + "].";
+		mPUpdateProgRef->uniform(loc + "first", system.first);
+		mPUpdateProgRef->uniform(loc + "activeCount", getActiveCount(system));
+		mPUpdateProgRef->uniform(loc + "lifetime", system.lifetime);
+		mPUpdateProgRef->uniform(loc + "bounciness", system.bounciness);
+		mPUpdateProgRef->uniform(loc + "drag", system.dragCoefficient);
+		mPUpdateProgRef->uniform(loc + "layers", system.layers);
+		mPUpdateProgRef->uniform(loc + "recycle", system.recycle);
+	}
+
+	mPUpdateProgRef->uniform("SleepEnabled", mSleepEnabled);
+	mPUpdateProgRef->uniform("SleepVelocity", mSleepVelocity);
+	mPUpdateProgRef->uniform("SleepFrames", mSleepFrames);
+	mPUpdateProgRef->uniform("WakeAll", mWakeAll || int(mWakeRegions.size()) > MAX_WAKE_REGIONS);
+	int wakeRegions = std::min(int(mWakeRegions.size()), MAX_WAKE_REGIONS);
+	for (int i = 0; i < wakeRegions; ++i) {
+		string loc = "wakeRegions[" + to_string(i) + "].";
+		mPUpdateProgRef->uniform(loc + "lower", mWakeRegions[i].getMin());
+		mPUpdateProgRef->uniform(loc + "upper", mWakeRegions[i].getMax());
+	}
+	mPUpdateProgRef->uniform("numWakeRegions", wakeRegions);
+	mWakeRegions.clear();
+	mWakeAll = false;
+}
+
+void ParticleManager::wakeParticles(const AxisAlignedBox& bounds)
+{
+	// Grow the region a little, so particles resting on a surface are included
+	const vec3 margin(0.25f);
+	mWakeRegions.push_back(AxisAlignedBox(bounds.getMin() - margin, bounds.getMax() + margin));
 }
 
 
 
-ForceField::ForceField(vec3 pos, CameraPersp* c)
+ForceField::ForceField(vec3 pos)
 {
 	position = pos;
-	cam = c;
 }
 
 bool ForceField::isSelected()
@@ -288,196 +912,137 @@ bool ForceField::isSelected()
 	return selected;
 }
 
+void ForceField::setSelected(bool s)
+{
+	selected = s;
+}
 
-SphericalForceField::SphericalForceField(vec3 pos, float radius_, CameraPersp * c) : ForceField(pos, c)
+
+SphericalForceField::SphericalForceField(vec3 pos, float radius_) : ForceField(pos)
 {
 	radius = radius_;
-
-	gl::GlslProgRef progRef = gl::getStockShader(gl::ShaderDef().color());
-	batchRef = gl::Batch::create(geom::Sphere().radius(radius), progRef);
 }
 
-SphericalForceField::~SphericalForceField()
+AxisAlignedBox SphericalForceField::getBounds() const
 {
-	connectionList.clear();
-	selectionLock = false;
+	return AxisAlignedBox(position - vec3(radius), position + vec3(radius));
 }
 
-void SphericalForceField::connectSignals()
+bool SphericalForceField::intersects(const Ray& ray, float* t) const
 {
-	connectionList.add(getWindow()->getSignalMouseDown().connect(std::bind(&SphericalForceField::mouseDown, this, std::placeholders::_1)));
-	connectionList.add(getWindow()->getSignalMouseDrag().connect(std::bind(&SphericalForceField::mouseDrag, this, std::placeholders::_1)));
-	connectionList.add(getWindow()->getSignalPostDraw().connect(std::bind(&SphericalForceField::draw, this)));
+	return intersectSphere(ray, position, radius, t);
 }
 
-
-void SphericalForceField::mouseDown(MouseEvent e)
+int SphericalForceField::pickHandle(const Ray& ray) const
 {
-	if (selectionLock && !selected) return;
-	if (!e.isLeft() || !e.isLeftDown()) return; //Only react to LMB
-												//Calculate the collision ray
-	Ray ray = cam->generateRay(e.getPos(), getWindow()->getSize());
-
-	selectedHandle = -1;
-	//if the volume is selected, collision test against vectors
-	if (selected) {
-		Sphere collisionSphere = Sphere(position + vec3(1, 0, 0) + vec3(1, 0, 0)*radius, 0.2f);
-		if (collisionSphere.intersects(ray))
-			selectedHandle = 0;
-		collisionSphere = Sphere(position + vec3(0, 1, 0) + vec3(0, 1, 0)*radius, 0.2f);
-		if (collisionSphere.intersects(ray))
-			selectedHandle = 1;
-		collisionSphere = Sphere(position + vec3(0, 0, 1) + vec3(0, 0, 1)*radius, 0.2f);
-		if (collisionSphere.intersects(ray))
-			selectedHandle = 2;
-	}
-	//If the Volume is not currently being moved, check for intersection
-	if (selectedHandle == -1) {
-		Sphere collisionSphere = Sphere(position, radius);
-		if (collisionSphere.intersects(ray)) {
-			selected = true;
-			selectionLock = true;
+	int handle = -1;
+	float nearest = std::numeric_limits<float>::max();
+	for (int axis = 0; axis < 3; ++axis) {
+		vec3 dir(0);
+		dir[axis] = 1;
+		float t;
+		if (intersectSphere(ray, position + dir + dir * radius, 0.2f, &t) && t < nearest) {
+			nearest = t;
+			handle = axis;
 		}
-		else {
-			selected = false;
-			selectionLock = false;
-		}
-
 	}
+	return handle;
 }
-void SphericalForceField::mouseDrag(MouseEvent e)
+
+void SphericalForceField::dragHandle(int handle, const Ray& ray)
 {
-	if (!selected || !e.isLeftDown())return;
-	Ray ray = cam->generateRay(e.getPos(), getWindow()->getSize());
-	if (selectedHandle == 0) {
-		float dist;
+	float dist;
+	if (handle == 0) {
 		ray.calcPlaneIntersection(position, vec3(0, 0, 1), &dist);
 		position.x = (ray.getOrigin() + ray.getDirection() * dist).x - 1 - radius;
 	}
-	if (selectedHandle == 1) {
-		float dist;
+	if (handle == 1) {
 		ray.calcPlaneIntersection(position, vec3(0, 0, 1), &dist);
 		position.y = (ray.getOrigin() + ray.getDirection() * dist).y - 1 - radius;
 	}
-	if (selectedHandle == 2) {
-		float dist;
+	if (handle == 2) {
 		ray.calcPlaneIntersection(position, vec3(0, 1, 0), &dist);
 		position.z = (ray.getOrigin() + ray.getDirection() * dist).z - 1 - radius;
 	}
-
 }
-void SphericalForceField::draw()
+
+void SphericalForceField::drawHandles()
 {
-	//Draw the volume
 	gl::pushMatrices();
 	gl::translate(position);
-	gl::color(ffColor.r, ffColor.g, ffColor.b, ffColor.a);
-	batchRef->draw();
-
-	if (selected) { //Draw the handles
-		gl::color(1, 0, 0, 1);
-		gl::drawVector(vec3(1, 0, 0)*radius, vec3(1, 0, 0) + vec3(1, 0, 0)*radius);
-		gl::color(0, 1, 0, 1);
-		gl::drawVector(vec3(0, 1, 0)*radius, vec3(0, 1, 0) + vec3(0, 1, 0)*radius);
-		gl::color(0, 0, 1, 1);
-		gl::drawVector(vec3(0, 0, 1)*radius, vec3(0, 0, 1) + vec3(0, 0, 1)*radius);
-	}
+	gl::color(1, 0, 0, 1);
+	gl::drawVector(vec3(1, 0, 0)*radius, vec3(1, 0, 0) + vec3(1, 0, 0)*radius);
+	gl::color(0, 1, 0, 1);
+	gl::drawVector(vec3(0, 1, 0)*radius, vec3(0, 1, 0) + vec3(0, 1, 0)*radius);
+	gl::color(0, 0, 1, 1);
+	gl::drawVector(vec3(0, 0, 1)*radius, vec3(0, 0, 1) + vec3(0, 0, 1)*radius);
 	gl::popMatrices();
-
 }
 
-CuboidForceField::CuboidForceField(vec3 pos, vec3 size_, CameraPersp* c) : ForceField(pos, c)
+CuboidForceField::CuboidForceField(vec3 pos, vec3 size_) : ForceField(pos)
 {
 	position = pos;
 	size = size_;
-	gl::GlslProgRef progRef = gl::getStockShader(gl::ShaderDef().color());
-	batchRef = gl::Batch::create(geom::Cube().size(size), progRef);
 }
 
-CuboidForceField::~CuboidForceField()
+AxisAlignedBox CuboidForceField::getBounds() const
 {
-	connectionList.clear();
-	selectionLock = false;
+	return AxisAlignedBox(position - size / 2.f, position + size / 2.f);
 }
 
-void CuboidForceField::connectSignals()
+bool CuboidForceField::intersects(const Ray& ray, float* t) const
 {
-	connectionList.add(getWindow()->getSignalMouseDown().connect(std::bind(&CuboidForceField::mouseDown, this, std::placeholders::_1)));
-	connectionList.add(getWindow()->getSignalMouseDrag().connect(std::bind(&CuboidForceField::mouseDrag, this, std::placeholders::_1)));
-	connectionList.add(getWindow()->getSignalPostDraw().connect(std::bind(&CuboidForceField::draw, this)));
+	return intersectBox(ray, position - size / 2.f, position + size / 2.f, t);
 }
 
-void CuboidForceField::mouseDown(MouseEvent e)
+int CuboidForceField::pickHandle(const Ray& ray) const
 {
-	if (selectionLock && !selected) return;
-	if (!e.isLeft() || !e.isLeftDown()) return; //Only react to LMB
-												//Calculate the collision ray
-	Ray ray = cam->generateRay(e.getPos(), getWindow()->getSize());
-	selectedHandle = -1;
-	if (selected) {
-		Sphere collisionSphere = Sphere(position + vec3(0.9f + size.x / 2, 0, 0), 0.2f);
-		if (collisionSphere.intersects(ray))
-			selectedHandle = 0;
-		collisionSphere = Sphere(position + vec3(0, 0.9f + size.y / 2, 0), 0.2f);
-		if (collisionSphere.intersects(ray))
-			selectedHandle = 1;
-		collisionSphere = Sphere(position + vec3(0, 0, 0.9f + size.z / 2), 0.2f);
-		if (collisionSphere.intersects(ray))
-			selectedHandle = 2;
-	}
-	if (selectedHandle == -1) {
-		AxisAlignedBox box(position - size / 2.f, position + size / 2.f);
-		if (box.intersects(ray)) {
-			selected = true;
-			selectionLock = true;
-		}
-		else {
-			selected = false;
-			selectionLock = false;
+	int handle = -1;
+	float nearest = std::numeric_limits<float>::max();
+	for (int axis = 0; axis < 3; ++axis) {
+		vec3 offset(0);
+		offset[axis] = 0.9f + size[axis] / 2;
+		float t;
+		if (intersectSphere(ray, position + offset, 0.2f, &t) && t < nearest) {
+			nearest = t;
+			handle = axis;
 		}
 	}
+	return handle;
 }
 
-void CuboidForceField::mouseDrag(MouseEvent e)
+void CuboidForceField::dragHandle(int handle, const Ray& ray)
 {
-	if (!selected || !e.isLeftDown())return;
-	Ray ray = cam->generateRay(e.getPos(), getWindow()->getSize());
-	if (selectedHandle == 0) {
-		float dist;
+	float dist;
+	if (handle == 0) {
 		ray.calcPlaneIntersection(position, vec3(0, 0, 1), &dist);
 		position.x = (ray.getOrigin() + ray.getDirection() * dist).x - 1 - size.x / 2;
 	}
-	if (selectedHandle == 1) {
-		float dist;
+	if (handle == 1) {
 		ray.calcPlaneIntersection(position, vec3(0, 0, 1), &dist);
 		position.y = (ray.getOrigin() + ray.getDirection() * dist).y - 1 - size.y / 2;
 	}
-	if (selectedHandle == 2) {
-		float dist;
+	if (handle == 2) {
 		ray.calcPlaneIntersection(position, vec3(0, 1, 0), &dist);
 		position.z = (ray.getOrigin() + ray.getDirection() * dist).z - 1 - size.z / 2;
 	}
 }
 
-void CuboidForceField::draw()
+void CuboidForceField::drawHandles()
 {
 	gl::pushMatrices();
 	gl::translate(position);
-	gl::color(ffColor.r, ffColor.g, ffColor.b, ffColor.a);
-	batchRef->draw();
-	if (selected) { //Draw the handles
-		gl::color(1, 0, 0, 1);
-		gl::drawVector(vec3(size.x / 2.f, 0, 0), vec3(1 + size.x / 2.f, 0, 0));
-		gl::color(0, 1, 0, 1);
-		gl::drawVector(vec3(0, size.y / 2.f, 0), vec3(0, 1 + size.y / 2.f, 0));
-		gl::color(0, 0, 1, 1);
-		gl::drawVector(vec3(0, 0, size.z / 2.f), vec3(0, 0, 1 + size.z / 2.f));
-	}
+	gl::color(1, 0, 0, 1);
+	gl::drawVector(vec3(size.x / 2.f, 0, 0), vec3(1 + size.x / 2.f, 0, 0));
+	gl::color(0, 1, 0, 1);
+	gl::drawVector(vec3(0, size.y / 2.f, 0), vec3(0, 1 + size.y / 2.f, 0));
+	gl::color(0, 0, 1, 1);
+	gl::drawVector(vec3(0, 0, size.z / 2.f), vec3(0, 0, 1 + size.z / 2.f));
 	gl::popMatrices();
 }
 
 
-DirectionForceField::DirectionForceField(vec3 pos, float rad, vec3 force_, CameraPersp* c) : SphericalForceField(pos, rad, c)
+DirectionForceField::DirectionForceField(vec3 pos, float rad, vec3 force_) : SphericalForceField(pos, rad)
 {
 	force = force_;
 	type = Directional;
@@ -485,22 +1050,83 @@ DirectionForceField::DirectionForceField(vec3 pos, float rad, vec3 force_, Camer
 }
 
 
-ExpansionForceField::ExpansionForceField(vec3 pos, float radius,float force_, CameraPersp * c) : SphericalForceField(pos, radius, c)
+ExpansionForceField::ExpansionForceField(vec3 pos, float radius,float force_) : SphericalForceField(pos, radius)
 {
 	force = force_;
 	type = Expansion;
 	ffColor = vec4(0, 1, 0, 0.1f);
 }
 
-ContractionForceField::ContractionForceField(vec3 pos, float radius,float force_, CameraPersp * c) : SphericalForceField(pos, radius, c)
+ContractionForceField::ContractionForceField(vec3 pos, float radius,float force_) : SphericalForceField(pos, radius)
 {
 	force = force_;
 	type = Contraction;
 	ffColor = vec4(0, 0, 1, 0.1f);
 }
 
-CuboidObstacle::CuboidObstacle(vec3 pos, vec3 size, CameraPersp * c) : CuboidForceField(pos,size,c)
+CuboidObstacle::CuboidObstacle(vec3 pos, vec3 size) : CuboidForceField(pos,size)
 {
 	type = CObstacle;
 	ffColor = vec4(0, 1, 1, 0.1f);
 }
+
+MeshObstacle::MeshObstacle(const geom::Source& source, vec3 pos, float scale_, quat orientation_) : CuboidForceField(pos, vec3(1))
+{
+	type = MObstacle;
+	ffColor = vec4(1, 1, 0, 0.2f);
+	scale = scale_;
+
+	TriMeshRef mesh = TriMesh::create(source, TriMesh::Format().positions());
+	// Pad the bake domain, so the zero crossing lies well inside the texture
+	resolution = ivec3(32);
+	AxisAlignedBox meshBounds = mesh->calcBoundingBox();
+	vec3 padding = meshBounds.getSize() * 0.1f + meshBounds.getSize() / vec3(resolution) * 2.0f;
+	localBounds = AxisAlignedBox(meshBounds.getMin() - padding, meshBounds.getMax() + padding);
+	setOrientation(orientation_);
+
+	// Not on the task pool: the main thread helps out with pool tasks while it
+	// waits for a frame, and could pick up a bake that takes seconds
+	AxisAlignedBox bounds = localBounds;
+	ivec3 res = resolution;
+	const std::atomic<bool>* cancel = &cancelBake;
+	pendingSdf = std::async(std::launch::async, [mesh, bounds, res, cancel] { return bakeSignedDistanceField(*mesh, bounds, res, cancel); });
+
+	gl::GlslProgRef progRef = gl::getStockShader(gl::ShaderDef().color());
+	batchRef = gl::Batch::create(*mesh, progRef);
+}
+
+void MeshObstacle::setOrientation(const quat& q)
+{
+	orientation = q;
+	// Extent of the rotated bake domain along the world axes
+	mat3 rotation = toMat3(orientation);
+	vec3 halfSize = localBounds.getExtents() * scale;
+	size = 2.0f * (abs(rotation[0]) * halfSize.x + abs(rotation[1]) * halfSize.y + abs(rotation[2]) * halfSize.z);
+}
+
+MeshObstacle::~MeshObstacle()
+{
+	// The future's destructor still joins the bake, which now returns right away
+	cancelBake = true;
+}
+
+bool MeshObstacle::finishBake()
+{
+	if (sdf || !pendingSdf.valid()) return false;
+	if (pendingSdf.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return false;
+	sdf = createSignedDistanceTexture(pendingSdf.get(), resolution);
+	return true;
+}
+
+void MeshObstacle::drawMesh()
+{
+	// position is the center of the bake domain
+	gl::pushMatrices();
+	gl::translate(position);
+	gl::rotate(orientation);
+	gl::scale(vec3(scale));
+	gl::translate(-localBounds.getCenter());
+	gl::color(ffColor.r, ffColor.g, ffColor.b, ffColor.a);
+	batchRef->draw();
+	gl::popMatrices();
+}
\ No newline at end of file
@@ -4,6 +4,19 @@
 #include "cinder/gl/gl.h"
 #include "Particles.h"
 #include "cinder/Noncopyable.h"
+#include "cinder/AxisAlignedBox.h"
+#include "cinder/TriMesh.h"
+#include "Picking.h"
+#include "SpawnRing.h"
+#include "RadixSort.h"
+#include "FenceRing.h"
+#include "FieldStore.h"
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
 
 using namespace ci;
 using namespace ci::app;
@@ -18,86 +31,163 @@ struct Particle {
 
 };
 
-enum ForceFieldType{Directional, Expansion, Contraction, CObstacle};
+// Resolution of the target particles are drawn into
+enum ParticleResolution{FullResolution, HalfResolution, QuarterResolution};
+
+// Settings of one particle effect. All systems share the particle buffers,
+// each one owns a contiguous range of them and is updated in the same pass.
+struct ParticleSystemDesc {
+	vec3 emitterPosition = vec3(0);
+	float emitterRadius = 1.0f; /* Particles are emitted on a sphere of this radius */
+	vec3 initialVelocity = vec3(-3, 2, 0);
+	float lifetime = 3.0f; /* Particle lifetime */
+	float bounciness = 0.01f; /* Particle bounciness */
+	float dragCoefficient = 0.0f;
+	int count = 2900;
+	int layers = -1; /* Fields affect the system if their layers share a bit with these */
+	bool recycle = true; /* Respawn dead particles at the emitter, or leave them dead */
+	int first = 0; /* Start of the system's range, assigned by the ParticleManager */
+	int renderResolution = FullResolution; /* ParticleResolution, soft effects can be drawn coarser */
+};
+
+// Compile-time configuration of an update shader permutation
+struct UpdateVariant {
+	int directional = 0, expansion = 0, contraction = 0;
+	int cuboids = 0, meshes = 0;
+	bool drag = false;
+
+	bool operator<(const UpdateVariant& other) const
+	{
+		return std::tie(directional, expansion, contraction, cuboids, meshes, drag)
+			< std::tie(other.directional, other.expansion, other.contraction, other.cuboids, other.meshes, other.drag);
+	}
+};
+
+// Order the particles are kept in, see ParticleManager::sortParticles
+enum ParticleSortMode{NoSort, DepthSort, MortonSort};
+
+enum ForceFieldType{Directional, Expansion, Contraction, CObstacle, MObstacle};
 
 class ForceField{
 public:
-	ForceField(vec3 pos, CameraPersp* cam);
-	virtual void connectSignals() =  0;
-	virtual void mouseDown(MouseEvent e) = 0;
-	virtual void mouseDrag(MouseEvent e) = 0;
-	virtual void draw() = 0;	
+	ForceField(vec3 pos);
+	// The volume itself is drawn instanced by the ParticleManager, fields
+	// only draw their move handles while selected
+	virtual void drawHandles() = 0;
+	virtual AxisAlignedBox getBounds() const = 0;
+	// Ray test against the volume, t is the distance to the hit
+	virtual bool intersects(const Ray& ray, float* t) const = 0;
+	// Index of the move handle hit by the ray, or -1
+	virtual int pickHandle(const Ray& ray) const = 0;
+	virtual void dragHandle(int handle, const Ray& ray) = 0;
 
 	bool isSelected();
+	void setSelected(bool s);
+	vec4 getColor() const { return ffColor; }
 
 	vec3 position;
 	ForceFieldType type;
-	ConnectionList connectionList;
+	int layers = -1; /* Affects particle systems that share one of these bits */
+	int proxy = -1; /* Leaf in the picking hierarchy */
+
+	// Bounds that were last uploaded to the particle update, used to wake
+	// sleeping particles around a field that moved
+	AxisAlignedBox syncedBounds;
+	bool synced = false;
 
 protected:
 	vec4 ffColor;
 	bool selected = false;
-	static bool selectionLock;
-	int selectedHandle = -1;
-	CameraPersp* cam;
 	
 };
 
 class SphericalForceField : public ForceField{
 public:
-	SphericalForceField(vec3 pos, float radius_, CameraPersp* c);
-	~SphericalForceField();
-	void connectSignals();
-	void mouseDown(MouseEvent e);
-	void mouseDrag(MouseEvent e);
-	void draw();
+	SphericalForceField(vec3 pos, float radius_);
+	void drawHandles();
+	AxisAlignedBox getBounds() const;
+	bool intersects(const Ray& ray, float* t) const;
+	int pickHandle(const Ray& ray) const;
+	void dragHandle(int handle, const Ray& ray);
 
 	float radius;
-protected:
-	gl::BatchRef batchRef;
 };
 
 class CuboidForceField : public ForceField {
 public:
-	CuboidForceField(vec3 pos, vec3 size, CameraPersp* c);
-	~CuboidForceField();
-	void connectSignals();
-	void mouseDown(MouseEvent e);
-	void mouseDrag(MouseEvent e);
-	void draw();
+	CuboidForceField(vec3 pos, vec3 size);
+	void drawHandles();
+	AxisAlignedBox getBounds() const;
+	bool intersects(const Ray& ray, float* t) const;
+	int pickHandle(const Ray& ray) const;
+	void dragHandle(int handle, const Ray& ray);
 
 	vec3 size;
-protected:
-	gl::BatchRef batchRef;
 };
 
 class CuboidObstacle : public CuboidForceField{
 public:
-	CuboidObstacle(vec3 pos, vec3 size, CameraPersp* c);
+	CuboidObstacle(vec3 pos, vec3 size);
+};
+
+// Obstacle with the shape of an arbitrary mesh. The mesh is baked into a signed
+// distance texture once, moving or rotating the obstacle only changes its uniforms.
+// The bake runs on its own thread, the obstacle has no effect until it is done.
+// Picking and dragging use the world space box around the rotated bake domain.
+class MeshObstacle : public CuboidForceField {
+public:
+	MeshObstacle(const geom::Source& source, vec3 pos, float scale_, quat orientation_ = quat());
+	// Cancels a running bake, so deleting the obstacle only waits for the current slice
+	~MeshObstacle();
+	// Unlike the other volumes the mesh is unique, so it keeps its own batch
+	void drawMesh();
+	// Creates the texture once the bake has finished, returns true if it just did
+	bool finishBake();
+	// Rotates about the center without a new bake
+	void setOrientation(const quat& q);
+
+	float scale;
+	quat orientation;
+	AxisAlignedBox localBounds; /* Bake domain in mesh space */
+	gl::Texture3dRef sdf; /* Null while the bake is running */
+protected:
+	gl::BatchRef batchRef;
+	std::atomic<bool> cancelBake{ false }; /* Declared first, so it outlives the bake */
+	std::future<std::vector<vec4>> pendingSdf;
+	ivec3 resolution;
 };
 
 class DirectionForceField : public SphericalForceField {
 public: 
-	DirectionForceField(vec3 pos,float radius, vec3 force_, CameraPersp* c);
+	DirectionForceField(vec3 pos,float radius, vec3 force_);
 	vec3 force;
 	
 };
 
 class ExpansionForceField : public SphericalForceField {
 public:
-	ExpansionForceField(vec3 pos, float radius,float force, CameraPersp* c);
+	ExpansionForceField(vec3 pos, float radius,float force);
 	float force;
 };
 
 class ContractionForceField : public SphericalForceField {
 public:
-	ContractionForceField(vec3 pos, float radius, float force, CameraPersp* c);
+	ContractionForceField(vec3 pos, float radius, float force);
 	float force;
 };
 
 class ParticleManager {
 public:
 	ParticleManager(CameraPersp* cam);
+	~ParticleManager();
+	// Walks the force fields and packs them on the CPU. Touches no GL state,
+	// so it can run on a worker thread while the main thread submits.
+	void packFields();
+	const FieldPack& getFieldPack() const { return mFieldPack; }
+	// The scene's field buffer, filled from getFieldPack() once per frame
+	void setFieldStore(FieldStore* store) { mFieldStore = store; }
+	// Uploads the per-system settings and binds what packFields gathered, on the main thread
+	void uploadFields();
 	void updateParticles();
 	void loadBuffers();
 	void draw();
@@ -106,25 +196,173 @@ public:
 	void addExpansionForceField(vec3 pos, float radius, float force);
 	void addContractionForceField(vec3 pos, float radius, float force);
 	void addCuboidObstacle(vec3 pos, vec3 size);
+	void addMeshObstacle(const geom::Source& source, vec3 pos, float scale, quat orientation = quat());
 	void deleteForceField();
 
 	void setForceFieldVisibility(bool visible);
 
-	float mBounciness = 0.01f; /* Particle bounciness */
-	float mDragCoefficient = 0.0f;
-	float mParticleLifetime = 3.0f; /* Particle lifetime */
+	void setActiveParticles(int count);
+	int getActiveParticles() const { return mActiveParticles; }
+	int getMaxParticles() const { return mNumParticles; }
+
+	// State written by the last update, which is also what gets drawn
+	gl::VboRef getPositions() const { return mPPositions[mCurrentSlot]; }
+	gl::VboRef getVelocities() const { return mPVelocities[mCurrentSlot]; }
+	gl::VboRef getStartTimes() const { return mPStartTimes[mCurrentSlot]; }
+
+	// The simulation state lives in a ring of buffer slots. The update reads the
+	// current slot and writes the next one. A deeper ring leaves more slots that
+	// the GPU is done with, which the CPU can read without waiting.
+	void setBufferDepth(int depth);
+	int getBufferDepth() const { return int(mPPositions.size()); }
+	// Copies the newest state the GPU has released, without blocking. Age is
+	// the number of updates since. Returns false if no slot is released yet.
+	bool readState(std::vector<vec3>* positions, std::vector<vec3>* velocities, int* age);
+	const FenceRing* getSlotFences() const { return mSlotFences.get(); }
+	// Simulated seconds, advanced by the timestep on every update. Lifetimes
+	// and start times are measured on this clock.
+	float getSimulationTime() const { return float(mSimulationTime); }
+
+	// Adds a system to the shared buffers, which are rebuilt. Returns its index,
+	// or -1 if there are too many systems or it has too many particles.
+	int addParticleSystem(const ParticleSystemDesc& desc);
+	// Settings can be changed in place, except for the count and the emitter
+	ParticleSystemDesc& getParticleSystem(int index) { return mSystems[index]; }
+	int getNumParticleSystems() const { return int(mSystems.size()); }
+
+	static const int MAX_PARTICLE_SYSTEMS = 16;
+	static const int MAX_SYSTEM_PARTICLES = 1 << 27; /* The sort keys hold 27 bits of slot */
+
+	// Creates the system that spawned particles go into. It doesn't recycle its
+	// particles, and spawning overwrites its oldest slots first. Up to
+	// capacityPerFrame particles can be spawned per frame.
+	int createSpawnSystem(const ParticleSystemDesc& desc, int capacityPerFrame);
+	// Queues a particle for the next update. Returns false if there is no spawn
+	// system or this frame's capacity is used up.
+	bool spawn(vec3 position, vec3 velocity);
+	const SpawnRing* getSpawnRing() const { return mSpawnRing.get(); }
+
+	float mPointSize = 5.0f; /* Rendered point size in pixels */
+	float mTimestep = 1.0f / 60.0f; /* Simulation timestep, collisions are swept so this can be raised */
+
+	bool mLodEnabled = false; /* Step far and offscreen particles less often */
+	float mLodNearDistance = 8.0f; /* Particles closer to the camera are stepped every frame */
+	int mLodInterval = 4; /* Step interval of far particles, offscreen ones use twice that */
+	float mMaxLodTimestep = 0.1f; /* Longest stretch of simulated time a far particle goes without a step */
+
+	bool mSleepEnabled = true; /* Skip particles that have come to rest */
+	float mSleepVelocity = 0.05f; /* Particles slower than this count as resting */
+	int mSleepFrames = 30; /* Resting steps before a particle falls asleep */
+
+	// Below full resolution, particles are drawn offscreen and composited with a
+	// depth-aware upsample, which trades sharpness for fill rate. Each system is
+	// drawn at its own renderResolution or this one, whichever is coarser.
+	int mRenderResolution = FullResolution;
+
+	// Depth sorting draws each system back to front, Morton order keeps
+	// neighbouring particles close in memory. Needs compute shaders.
+	int mSortMode = NoSort;
+	int mSortInterval = 1; /* Frames between sorts */
+	AxisAlignedBox mSortBounds = AxisAlignedBox(vec3(-50), vec3(50)); /* Domain of the Morton codes */
+
+	// Specialized update shaders for the current field mix, with the field
+	// counts rounded up to 0, 2 or the maximum. A missing variant is compiled
+	// on a thread with its own shared context, and the generic shader stands in
+	// until it is ready. Whenever fields are added or removed, the variants for
+	// the new mix and for one more field of any type are queued ahead of time.
+	// Scenes can queue others up front with prewarmVariants.
+	bool mUseVariants = true;
+	void prewarmVariants(const std::vector<UpdateVariant>& variants);
+	int getNumVariants() const { return int(mVariants.size()); }
+	bool isVariantActive() const { return mPUpdateProgRef != mGenericUpdateProgRef; }
 private:
-	int mNumParticles = 2900;
-	gl::VaoRef	mPVao[2];
-	gl::TransformFeedbackObjRef mPFeedback[2];
-	gl::VboRef	mPPositions[2], mPVelocities[2], mPStartTimes[2], mPInitVelocity, mPInitPosition;
-	gl::GlslProgRef mPUpdateProgRef, mPRenderProgRef;
-	int mActiveBuffer = 1;
+	int mNumParticles = 0; /* Sum over all systems */
+	int mActiveParticles = 0; /* Spread over the systems in proportion to their size */
+	// Reserved to MAX_PARTICLE_SYSTEMS, so references handed out stay valid
+	std::vector<ParticleSystemDesc> mSystems, mSyncedSystems;
+	int mSpawnSystem = -1;
+	int mSpawnCursor = 0; /* Next slot to be overwritten, relative to the spawn system */
+	std::unique_ptr<SpawnRing> mSpawnRing;
+	std::vector<gl::VaoRef>	mPVao;
+	std::vector<gl::TransformFeedbackObjRef> mPFeedback;
+	std::vector<gl::VboRef>	mPPositions, mPVelocities, mPStartTimes, mPStepStates;
+	gl::VboRef	mPInitVelocity, mPInitPosition, mPSystemIndices;
+	gl::GlslProgRef mPUpdateProgRef, mPRenderProgRef, mCompositeProgRef;
+	gl::GlslProgRef mGenericUpdateProgRef; /* Counts from uniforms, fits every scene */
+	struct CachedVariant {
+		gl::GlslProgRef prog;
+		uint32_t lastUsed = 0; /* Frame the variant was last selected in */
+	};
+	static const int MAX_CACHED_VARIANTS = 16; /* Least recently used ones are dropped beyond this */
+	std::map<UpdateVariant, CachedVariant> mVariants;
+	std::thread mCompileThread;
+	std::mutex mCompileMutex;
+	std::condition_variable mCompileRequested;
+	std::vector<UpdateVariant> mPendingVariants; /* Requested, guarded by mCompileMutex */
+	std::vector<std::pair<UpdateVariant, gl::GlslProgRef>> mCompiledVariants; /* Ready, guarded by mCompileMutex */
+	bool mStopCompiling = false; /* Guarded by mCompileMutex */
+	int mBufferDepth = 3;
+	int mCurrentSlot = 0; /* Slot written by the last update, which is drawn */
+	double mSimulationTime = 0.0; /* Kept in double, a float clock loses precision within hours */
+	std::unique_ptr<FenceRing> mSlotFences;
 	CameraPersp* mCam;
 
 	std::list<shared_ptr<ForceField>> forceFields;
+	PickingService mPicking;
+	bool mForceFieldsVisible = true;
+
+	static const int MAX_MESH_OBSTACLES = FieldStore::MAX_MESH_OBSTACLES;
+	static const int MAX_FIELDS_PER_TYPE = FieldStore::MAX_FIELDS_PER_TYPE;
+	std::vector<gl::Texture3dRef> mMeshObstacleSdfs; /* Bound to texture units 0..3 during the update */
+
+	FieldPack mFieldPack; /* As gathered by packFields */
+	FieldStore* mFieldStore = nullptr;
+
+	// Regions in which sleeping particles are woken up this frame
+	static const int MAX_WAKE_REGIONS = 8;
+	std::vector<AxisAlignedBox> mWakeRegions;
+	bool mWakeAll = false;
 
 	void loadShaders();
-	void updateUniforms();
+	gl::GlslProgRef createUpdateProgram(const UpdateVariant* variant);
+	void selectUpdateProgram();
+	UpdateVariant makeVariant(int directional, int expansion, int contraction, int cuboids, int meshes) const;
+	void requestVariant(const UpdateVariant& variant);
+	void prewarmFieldMix();
+	void compileLoop(gl::ContextRef context);
+	void cacheVariant(const UpdateVariant& variant, gl::GlslProgRef prog);
+	void wakeParticles(const AxisAlignedBox& bounds);
+	void addForceField(shared_ptr<ForceField> ff);
+	void drawParticles(float pointScale, int resolution);
+	int getRenderResolution(const ParticleSystemDesc& system) const { return std::max(system.renderResolution, mRenderResolution); }
+	void sortParticles();
+	std::unique_ptr<RadixSort> mRadixSort;
+	gl::GlslProgRef mSortKeysProgRef;
+	gl::BufferObjRef mSortKeys, mSortValues, mSortScratch;
+	void drawReducedResolution(int resolution);
+	gl::FboRef mParticleFbos[3]; /* Reduced resolution color and scene depth, by resolution */
+	gl::FboRef mSceneDepthFbo; /* Full resolution copy of the scene depth */
+	GLint mDepthFormat = GL_NONE; /* Of the window's depth buffer, depth blits need an exact match */
+	int getActiveCount(const ParticleSystemDesc& system) const;
+
+	// Field volumes are drawn with one instanced call per shape. The instance
+	// buffers are only rewritten when a field was added, removed or moved.
+	struct GizmoInstance {
+		vec3 position;
+		vec3 scale;
+		vec4 color;
+	};
+	struct GizmoBatch {
+		gl::BatchRef batch;
+		gl::VboRef instances;
+		size_t capacity = 0;
+		std::vector<GizmoInstance> data;
+	};
+	GizmoBatch mSphereGizmos, mCubeGizmos;
+	gl::GlslProgRef mGizmoProgRef;
+	bool mGizmosDirty = true;
+
+	void drawForceFields();
+	void uploadGizmos(GizmoBatch& gizmos, const geom::Source& shape);
 
 };
\ No newline at end of file
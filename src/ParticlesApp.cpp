@@ -4,7 +4,12 @@
 #include "CamControl.h"
 #include "Particles.h"
 #include "Cloth.h"
+#include "QualityGovernor.h"
+#include "SimulationStats.h"
+#include "FrameGraph.h"
+#include "SlabSimulation.h"
 #include "cinder/params/Params.h"
+#include "cinder/Rand.h"
 
 using namespace ci;
 using namespace ci::app;
@@ -17,15 +22,23 @@ class ParticlesApp : public App {
 	void update() override;
 	void draw() override;
 	void resize() override;
+	void cleanup() override;
 
 
 private:
 	CameraPersp mCam;
 	ParticleManager* pm;
 	ClothSimulator* cs;
+	QualityGovernor* governor;
+	SimulationStats* stats;
+	FieldStore* fieldStore;
+	TaskPool* taskPool;
+	FrameGraph* frameGraph;
+	SlabSimulation* slabs = nullptr;
 	params::InterfaceGlRef interfaceRef;
 
 	float mAvgFps = 0;
+	int mFenceWaits = 0; /* Times the CPU blocked on a simulation buffer */
 	gl::BatchRef mSkyBoxBatch;
 	gl::TextureCubeMapRef	mCubeMap;
 
@@ -35,19 +48,51 @@ private:
 	float ffPower = 3.f;
 	vec3 cPosition = vec3(-2, 0, 0);
 	vec3 cSize = vec3(2, 2, 2);
+	quat cRotation;
 	bool drawMode = true;
+	int mNumSlabs = 4;
+	int mSlabParticles = 200000; /* Capacity per slab, half of it seeded */
+	int mSlabGathered = 0, mSlabSteps = 0;
 };
 
 void ParticlesApp::setup()
 {
+	governor = new QualityGovernor();
 	pm = new ParticleManager(&mCam);
 	cs = new ClothSimulator(&mCam);
+	governor->attach(pm, cs);
+	stats = new SimulationStats();
+	stats->attach(pm, cs);
+	// One copy of the fields on the GPU for both simulations
+	fieldStore = new FieldStore();
+	pm->setFieldStore(fieldStore);
+	cs->setFieldStore(fieldStore);
+
+	// The work of a frame. Field packing runs on the pool and feeds the one field
+	// buffer both simulations read, everything touching GL stays on the main thread.
+	taskPool = new TaskPool();
+	frameGraph = new FrameGraph(taskPool);
+	frameGraph->addStage("fields.pack", CpuStage, {}, { "fieldPack", "picking" }, [&] { pm->packFields(); });
+	frameGraph->addStage("fields.upload", GpuStage, { "fieldPack" }, { "fieldBuffer" }, [&] { fieldStore->upload(pm->getFieldPack()); });
+	frameGraph->addStage("cloth.update", GpuStage, { "fieldBuffer" }, { "cloth" }, [&] { cs->update(); });
+	frameGraph->addStage("particles.upload", GpuStage, { "fieldPack" }, { "particleUniforms" }, [&] { pm->uploadFields(); });
+	frameGraph->addStage("particles.update", GpuStage, { "particleUniforms", "fieldBuffer" }, { "particles" }, [&] { pm->updateParticles(); });
+	frameGraph->addStage("stats.reduce", GpuStage, { "particles", "cloth" }, { "stats" }, [&] { stats->update(); });
+	frameGraph->addStage("stats.bounds", CpuStage, { "stats" }, { "sortBounds" }, [&] {
+		// The measured bounds make a tighter domain for the Morton sort
+		if (stats->mValid && stats->mParticles.count > 0)
+			pm->mSortBounds = AxisAlignedBox(stats->mParticles.boundsMin, stats->mParticles.boundsMax);
+	});
+	// Only reads the shared segment, the worker processes do the simulating
+	frameGraph->addStage("slabs.gather", CpuStage, {}, { "slabs" }, [&] { if (slabs) slabs->gather(); });
+	frameGraph->compile();
 
 	interfaceRef = params::InterfaceGl::create(getWindow(), "Particles Animation Exercise", toPixels(ivec2(225, 400)));
 	interfaceRef->addParam("FPS: ", &mAvgFps);
 	interfaceRef->addSeparator();
 	interfaceRef->addButton("Switch Draw Mode", std::function<void()>([&] {drawMode = !drawMode; pm->setForceFieldVisibility(drawMode); }));
 	interfaceRef->addParam("Wind on/off", &cs->wind);
+	interfaceRef->addParam("Cloth field strength", &cs->fieldStrength).step(0.001f).min(0.0f).max(1.0f);
 	interfaceRef->addSeparator();
 	interfaceRef->addText("Settings for new ForceFields");
 	interfaceRef->addParam("Position", &ffPosition);
@@ -63,10 +108,101 @@ void ParticlesApp::setup()
 	interfaceRef->addParam("Cuboid Position", &cPosition);
 	interfaceRef->addParam("Cuboid Size", &cSize);
 	interfaceRef->addButton("New Cuboid Obstacle", std::bind(&ParticleManager::addCuboidObstacle, pm, ref(cPosition), ref(cSize)));
+	interfaceRef->addParam("Teapot Rotation", &cRotation);
+	interfaceRef->addButton("New Teapot Obstacle", std::function<void()>([&] {pm->addMeshObstacle(geom::Teapot().subdivisions(6), cPosition, cSize.x, cRotation); }));
 	interfaceRef->addSeparator();
 	interfaceRef->addText("Settings for Particles");
-	interfaceRef->addParam("Bounciness", &pm->mBounciness).step(0.001f).min(0.05f).max(2.0f);
-	interfaceRef->addParam("Drag coefficient", &pm->mDragCoefficient).step(0.001f).min(0.0f).max(10.0f);
+	interfaceRef->addParam("Bounciness", &pm->getParticleSystem(0).bounciness).step(0.001f).min(0.05f).max(2.0f);
+	interfaceRef->addParam("Drag coefficient", &pm->getParticleSystem(0).dragCoefficient).step(0.001f).min(0.0f).max(10.0f);
+	interfaceRef->addButton("New Particle System", std::function<void()>([&] {
+		ParticleSystemDesc desc;
+		desc.emitterPosition = ffPosition;
+		desc.emitterRadius = 0.2f;
+		desc.initialVelocity = ffForce * 0.2f;
+		desc.count = 500;
+		pm->addParticleSystem(desc);
+	}));
+	interfaceRef->addButton("Spawn Burst", std::function<void()>([&] {
+		ParticleSystemDesc desc;
+		desc.count = 65536;
+		pm->createSpawnSystem(desc, 32768);
+		for (int i = 0; i < 10000; ++i)
+			pm->spawn(ffPosition, ffForce * 0.2f + Rand::randVec3() * 2.0f);
+	}));
+	interfaceRef->addParam("Particle resolution", { "Full", "Half", "Quarter" }, &pm->mRenderResolution);
+	interfaceRef->addParam("Particle sort", { "None", "Depth", "Morton" }, &pm->mSortMode);
+	interfaceRef->addParam("Sort interval", &pm->mSortInterval).min(1).max(120);
+	interfaceRef->addParam("Shader variants on/off", &pm->mUseVariants);
+	interfaceRef->addParam("Timestep", &pm->mTimestep).step(0.001f).min(0.001f).max(0.1f);
+	interfaceRef->addParam("LOD on/off", &pm->mLodEnabled);
+	interfaceRef->addParam("LOD near distance", &pm->mLodNearDistance).step(0.5f).min(0.0f).max(100.0f);
+	interfaceRef->addParam("LOD interval", &pm->mLodInterval).min(1).max(16);
+	interfaceRef->addParam("Sleep on/off", &pm->mSleepEnabled);
+	interfaceRef->addParam("Sleep velocity", &pm->mSleepVelocity).step(0.005f).min(0.0f).max(1.0f);
+	interfaceRef->addParam("Sleep frames", &pm->mSleepFrames).min(1).max(600);
+	interfaceRef->addSeparator();
+	interfaceRef->addText("Quality governor");
+	interfaceRef->addParam("Governor on/off", &governor->mEnabled);
+	interfaceRef->addParam("Target frame time (ms)", &governor->mTargetFrameTime).step(0.1f).min(1.0f).max(100.0f);
+	interfaceRef->addParam("Frame time (ms)", &governor->mFrameTime, true);
+	interfaceRef->addParam("CPU time (ms)", &governor->mCpuTime, true);
+	interfaceRef->addParam("GPU time (ms)", &governor->mGpuTime, true);
+	interfaceRef->addParam("Quality level", &governor->mLevel, true);
+	interfaceRef->addParam("Active particles", &governor->mActiveParticles, true);
+	interfaceRef->addParam("Cloth iterations", &governor->mClothIterations, true);
+	interfaceRef->addParam("Point size", &governor->mPointSize, true);
+	interfaceRef->addParam("Render resolution", { "Full", "Half", "Quarter" }, &governor->mRenderResolution, true);
+	interfaceRef->addSeparator();
+	interfaceRef->addText("Statistics");
+	interfaceRef->addParam("Statistics on/off", &stats->mEnabled);
+	interfaceRef->addParam("Alive particles", &stats->mParticles.count, true);
+	interfaceRef->addParam("Particle bounds min", &stats->mParticles.boundsMin, true);
+	interfaceRef->addParam("Particle bounds max", &stats->mParticles.boundsMax, true);
+	interfaceRef->addParam("Mean speed", &stats->mParticles.meanSpeed, true);
+	interfaceRef->addParam("Max speed", &stats->mParticles.maxSpeed, true);
+	interfaceRef->addParam("Kinetic energy", &stats->mParticles.kineticEnergy, true);
+	interfaceRef->addParam("Cloth max speed", &stats->mCloth.maxSpeed, true);
+	interfaceRef->addParam("Cloth kinetic energy", &stats->mCloth.kineticEnergy, true);
+	interfaceRef->addParam("Cloth max stretch", &stats->mCloth.maxStretch, true);
+	interfaceRef->addParam("Unstable", &stats->mUnstable, true);
+	interfaceRef->addParam("Readback latency (frames)", &stats->mLatency, true);
+	interfaceRef->addSeparator();
+	interfaceRef->addText("Frame graph");
+	interfaceRef->addParam("Critical path (ms)", &frameGraph->mCriticalPath, true);
+	interfaceRef->addParam("Frame graph time (ms)", &frameGraph->mCriticalPathTime, true);
+	interfaceRef->addParam("Serial stage time (ms)", &frameGraph->mSerialTime, true);
+	interfaceRef->addSeparator();
+	interfaceRef->addText("Simulation buffers");
+	interfaceRef->addParam<int>("Particle buffer depth", [&](int depth) { pm->setBufferDepth(depth); }, [&] { return pm->getBufferDepth(); }).min(2).max(4);
+	interfaceRef->addParam<int>("Cloth buffer depth", [&](int depth) { cs->setBufferDepth(depth); }, [&] { return cs->getBufferDepth(); }).min(2).max(4);
+	interfaceRef->addParam("Fence waits", &mFenceWaits, true);
+	interfaceRef->addSeparator();
+	interfaceRef->addText("Slab simulation");
+	interfaceRef->addParam("Slab workers", &mNumSlabs).min(1).max(64);
+	interfaceRef->addParam("Particles per slab", &mSlabParticles).min(1000).step(1000);
+	interfaceRef->addButton("Start/stop slab simulation", std::function<void()>([&] {
+		if (slabs) {
+			delete slabs;
+			slabs = nullptr;
+			return;
+		}
+		// Carries the GPU particles over when a slot of their ring is released,
+		// and falls back to random ones rather than stall the frame
+		std::vector<vec3> positions, velocities;
+		std::vector<SlabParticle> seed;
+		if (pm->readState(&positions, &velocities, nullptr)) {
+			seed.resize(positions.size());
+			for (size_t i = 0; i < positions.size(); ++i)
+				seed[i] = { positions[i], velocities[i] };
+		}
+		slabs = new SlabSimulation(mNumSlabs, mSlabParticles, AxisAlignedBox(vec3(-8, -4, -4), vec3(8, 4, 4)), seed);
+		if (!slabs->isRunning()) {
+			delete slabs;
+			slabs = nullptr;
+		}
+	}));
+	interfaceRef->addParam("Slab particles", &mSlabGathered, true);
+	interfaceRef->addParam("Slab steps", &mSlabSteps, true);
 
 	CamControl::SetCam(&mCam);
 	mCam.setEyePoint(vec3(0, 0, -10));
@@ -76,8 +212,16 @@ void ParticlesApp::setup()
 	auto skyBoxGlsl = gl::GlslProg::create(loadAsset("sky_box.vert"), loadAsset("sky_box.frag"));
 	mSkyBoxBatch = gl::Batch::create(geom::Cube(), skyBoxGlsl);
 	mSkyBoxBatch->getGlslProg()->uniform("uCubeMapTex", 0);
-	ImageSourceRef cMapImgs[6] = { loadImage(loadAsset("cubemap/posx.jpg")),loadImage(loadAsset("cubemap/negx.jpg")),loadImage(loadAsset("cubemap/posy.jpg")),
-		loadImage(loadAsset("cubemap/negy.jpg")),loadImage(loadAsset("cubemap/posz.jpg")),loadImage(loadAsset("cubemap/negz.jpg")), };
+	// Decode the six faces in parallel, only the upload needs the main thread
+	const char* cMapFiles[6] = { "cubemap/posx.jpg", "cubemap/negx.jpg", "cubemap/posy.jpg", "cubemap/negy.jpg", "cubemap/posz.jpg", "cubemap/negz.jpg" };
+	Surface8u cMapSurfaces[6];
+	TaskGroup decoding;
+	for (int i = 0; i < 6; ++i)
+		taskPool->submit([&, i] { cMapSurfaces[i] = Surface8u(loadImage(loadAsset(cMapFiles[i]))); }, &decoding);
+	taskPool->wait(decoding);
+	ImageSourceRef cMapImgs[6];
+	for (int i = 0; i < 6; ++i)
+		cMapImgs[i] = cMapSurfaces[i];
 	mCubeMap = gl::TextureCubeMap::create(cMapImgs, gl::TextureCubeMap::Format().mipmap());
 }
 
@@ -88,6 +232,11 @@ void ParticlesApp::mouseDown( MouseEvent event )
 void ParticlesApp::update()
 {
 	mAvgFps = getAverageFps();
+	mFenceWaits = int(pm->getSlotFences()->getWaits() + cs->getSlotFences()->getWaits() + fieldStore->getFences().getWaits());
+	if (pm->getSpawnRing()) mFenceWaits += int(pm->getSpawnRing()->getFenceWaits());
+	frameGraph->execute();
+	mSlabGathered = slabs ? slabs->mGatheredParticles : 0;
+	mSlabSteps = slabs ? slabs->mCompletedSteps : 0;
 }
 
 void ParticlesApp::draw()
@@ -99,11 +248,24 @@ void ParticlesApp::draw()
 	gl::scale(500.0, 500.0, 500.0);
 	mSkyBoxBatch->draw();
 	gl::popMatrices();
-	if(drawMode)
+	if (slabs)
+		slabs->draw();
+	else if(drawMode)
 		pm->draw();
 	else
 		cs->draw();
 	interfaceRef->draw();
+	governor->endFrame();
+}
+
+void ParticlesApp::cleanup()
+{
+	// Stops the worker processes before the shared memory goes away
+	delete slabs;
+	slabs = nullptr;
+	// Joins the shader compile thread while the context is still around
+	delete pm;
+	pm = nullptr;
 }
 
 void ParticlesApp::resize()
@@ -113,5 +275,9 @@ void ParticlesApp::resize()
 
 CINDER_APP( ParticlesApp, RendererGl(),
 	[&](App::Settings *settings) {
+	// Slab workers are copies of this executable and never open a window
+	const vector<string>& args = settings->getCommandLineArgs();
+	if (args.size() >= 4 && args[1] == SLAB_WORKER_ARG)
+		exit(runSlabWorker(args[2], stoi(args[3])));
 	settings->setWindowSize(1280, 720);
 })
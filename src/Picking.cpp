@@ -0,0 +1,274 @@
+#include "Picking.h"
+#include "Particles.h"
+#include <limits>
+
+bool intersectSphere(const Ray& ray, vec3 center, float radius, float* t)
+{
+	vec3 dir = normalize(ray.getDirection());
+	vec3 oc = ray.getOrigin() - center;
+	float b = dot(oc, dir);
+	float c = dot(oc, oc) - radius * radius;
+	float disc = b * b - c;
+	if (disc < 0.0f) return false;
+
+	float sq = std::sqrt(disc);
+	float hit = -b - sq;
+	if (hit < 0.0f) hit = -b + sq; // origin inside the sphere
+	if (hit < 0.0f) return false;
+	*t = hit;
+	return true;
+}
+
+bool intersectBox(const Ray& ray, vec3 lower, vec3 upper, float* t)
+{
+	vec3 dir = normalize(ray.getDirection());
+	float tEnter = 0.0f, tExit = std::numeric_limits<float>::max();
+	for (int axis = 0; axis < 3; ++axis) {
+		if (std::abs(dir[axis]) < 1e-8f) {
+			if (ray.getOrigin()[axis] < lower[axis] || ray.getOrigin()[axis] > upper[axis]) return false;
+			continue;
+		}
+		float t0 = (lower[axis] - ray.getOrigin()[axis]) / dir[axis];
+		float t1 = (upper[axis] - ray.getOrigin()[axis]) / dir[axis];
+		if (t0 > t1) std::swap(t0, t1);
+		tEnter = std::max(tEnter, t0);
+		tExit = std::min(tExit, t1);
+		if (tEnter > tExit) return false;
+	}
+	*t = tEnter;
+	return true;
+}
+
+int AabbTree::allocateNode()
+{
+	if (mFreeNodes.empty()) {
+		mNodes.push_back(Node());
+		return int(mNodes.size()) - 1;
+	}
+	int node = mFreeNodes.back();
+	mFreeNodes.pop_back();
+	mNodes[node] = Node();
+	return node;
+}
+
+void AabbTree::freeNode(int node)
+{
+	mFreeNodes.push_back(node);
+}
+
+int AabbTree::insert(ForceField* ff, const AxisAlignedBox& bounds)
+{
+	int leaf = allocateNode();
+	mNodes[leaf].field = ff;
+	mNodes[leaf].lower = bounds.getMin() - vec3(mMargin);
+	mNodes[leaf].upper = bounds.getMax() + vec3(mMargin);
+	insertLeaf(leaf);
+	++mLeaves;
+	return leaf;
+}
+
+void AabbTree::remove(int proxy)
+{
+	removeLeaf(proxy);
+	freeNode(proxy);
+	--mLeaves;
+}
+
+bool AabbTree::move(int proxy, const AxisAlignedBox& bounds)
+{
+	Node& n = mNodes[proxy];
+	if (all(greaterThanEqual(bounds.getMin(), n.lower)) && all(lessThanEqual(bounds.getMax(), n.upper)))
+		return false;
+
+	removeLeaf(proxy);
+	mNodes[proxy].lower = bounds.getMin() - vec3(mMargin);
+	mNodes[proxy].upper = bounds.getMax() + vec3(mMargin);
+	insertLeaf(proxy);
+	return true;
+}
+
+namespace {
+
+float surfaceArea(vec3 lower, vec3 upper)
+{
+	vec3 d = upper - lower;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+}
+
+void AabbTree::insertLeaf(int leaf)
+{
+	if (mRoot == -1) {
+		mRoot = leaf;
+		mNodes[leaf].parent = -1;
+		return;
+	}
+
+	// Descend towards the sibling that grows the least, by surface area
+	vec3 lower = mNodes[leaf].lower, upper = mNodes[leaf].upper;
+	int index = mRoot;
+	while (!mNodes[index].isLeaf()) {
+		const Node& n = mNodes[index];
+		float area = surfaceArea(n.lower, n.upper);
+		float combined = surfaceArea(glm::min(n.lower, lower), glm::max(n.upper, upper));
+		// Cost of making a new parent here, and the inherited cost of going down
+		float cost = 2.0f * combined;
+		float inherited = 2.0f * (combined - area);
+
+		float childCost[2];
+		int children[2] = { n.left, n.right };
+		for (int i = 0; i < 2; ++i) {
+			const Node& c = mNodes[children[i]];
+			float grown = surfaceArea(glm::min(c.lower, lower), glm::max(c.upper, upper));
+			childCost[i] = c.isLeaf() ? grown + inherited : grown - surfaceArea(c.lower, c.upper) + inherited;
+		}
+		if (cost < childCost[0] && cost < childCost[1]) break;
+		index = childCost[0] < childCost[1] ? children[0] : children[1];
+	}
+
+	int sibling = index;
+	int oldParent = mNodes[sibling].parent;
+	int newParent = allocateNode();
+	mNodes[newParent].parent = oldParent;
+	mNodes[newParent].left = sibling;
+	mNodes[newParent].right = leaf;
+	mNodes[sibling].parent = newParent;
+	mNodes[leaf].parent = newParent;
+
+	if (oldParent == -1) {
+		mRoot = newParent;
+	}
+	else if (mNodes[oldParent].left == sibling) {
+		mNodes[oldParent].left = newParent;
+	}
+	else {
+		mNodes[oldParent].right = newParent;
+	}
+	refit(newParent);
+}
+
+void AabbTree::removeLeaf(int leaf)
+{
+	if (leaf == mRoot) {
+		mRoot = -1;
+		return;
+	}
+
+	int parent = mNodes[leaf].parent;
+	int grandParent = mNodes[parent].parent;
+	int sibling = mNodes[parent].left == leaf ? mNodes[parent].right : mNodes[parent].left;
+
+	if (grandParent == -1) {
+		mRoot = sibling;
+		mNodes[sibling].parent = -1;
+	}
+	else {
+		if (mNodes[grandParent].left == parent) mNodes[grandParent].left = sibling;
+		else mNodes[grandParent].right = sibling;
+		mNodes[sibling].parent = grandParent;
+		refit(grandParent);
+	}
+	freeNode(parent);
+}
+
+void AabbTree::refit(int node)
+{
+	// Walk up to the root, growing each ancestor to hold its children
+	while (node != -1) {
+		Node& n = mNodes[node];
+		n.lower = glm::min(mNodes[n.left].lower, mNodes[n.right].lower);
+		n.upper = glm::max(mNodes[n.left].upper, mNodes[n.right].upper);
+		node = n.parent;
+	}
+}
+
+ForceField* AabbTree::raycast(const Ray& ray, float* t) const
+{
+	ForceField* nearest = nullptr;
+	float best = std::numeric_limits<float>::max();
+	if (mRoot == -1) return nullptr;
+
+	std::vector<int> stack;
+	stack.push_back(mRoot);
+	while (!stack.empty()) {
+		int index = stack.back();
+		stack.pop_back();
+		const Node& n = mNodes[index];
+
+		// Skip subtrees that can't contain a closer hit
+		float boxT;
+		if (!intersectBox(ray, n.lower, n.upper, &boxT) || boxT > best) continue;
+
+		if (n.isLeaf()) {
+			float hit;
+			if (n.field->intersects(ray, &hit) && hit < best) {
+				best = hit;
+				nearest = n.field;
+			}
+		}
+		else {
+			stack.push_back(n.left);
+			stack.push_back(n.right);
+		}
+	}
+	if (nearest) *t = best;
+	return nearest;
+}
+
+PickingService::PickingService(CameraPersp* cam)
+{
+	mCam = cam;
+}
+
+void PickingService::add(ForceField* ff)
+{
+	ff->proxy = mTree.insert(ff, ff->getBounds());
+}
+
+void PickingService::remove(ForceField* ff)
+{
+	if (ff == mSelected) select(nullptr);
+	mTree.remove(ff->proxy);
+	ff->proxy = -1;
+}
+
+void PickingService::update(ForceField* ff)
+{
+	mTree.move(ff->proxy, ff->getBounds());
+}
+
+void PickingService::setEnabled(bool enabled)
+{
+	mEnabled = enabled;
+	if (!enabled) select(nullptr);
+}
+
+void PickingService::select(ForceField* ff)
+{
+	if (mSelected) mSelected->setSelected(false);
+	mSelected = ff;
+	if (mSelected) mSelected->setSelected(true);
+}
+
+void PickingService::mouseDown(MouseEvent e)
+{
+	if (!mEnabled) return;
+	if (!e.isLeft() || !e.isLeftDown()) return; //Only react to LMB
+	Ray ray = mCam->generateRay(e.getPos(), getWindow()->getSize());
+
+	//If a volume is selected, its handles take precedence
+	mSelectedHandle = mSelected ? mSelected->pickHandle(ray) : -1;
+	if (mSelectedHandle != -1) return;
+
+	float t;
+	select(mTree.raycast(ray, &t));
+}
+
+void PickingService::mouseDrag(MouseEvent e)
+{
+	if (!mEnabled || !mSelected || mSelectedHandle == -1 || !e.isLeftDown()) return;
+	Ray ray = mCam->generateRay(e.getPos(), getWindow()->getSize());
+	mSelected->dragHandle(mSelectedHandle, ray);
+	mTree.move(mSelected->proxy, mSelected->getBounds());
+}
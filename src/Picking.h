@@ -0,0 +1,80 @@
+#pragma once
+#include "cinder/app/App.h"
+#include "cinder/gl/gl.h"
+#include "cinder/AxisAlignedBox.h"
+#include "cinder/Ray.h"
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+class ForceField;
+
+// Ray tests shared by the picking structure and the force fields.
+// They return the distance along the ray to the first hit in t.
+bool intersectSphere(const Ray& ray, vec3 center, float radius, float* t);
+bool intersectBox(const Ray& ray, vec3 lower, vec3 upper, float* t);
+
+// Dynamic bounding volume hierarchy over force fields. Leaves store fattened
+// bounds, so small moves don't touch the tree at all, and larger ones only
+// re-insert the one leaf that moved.
+class AabbTree {
+public:
+	int insert(ForceField* ff, const AxisAlignedBox& bounds);
+	void remove(int proxy);
+	// Returns true if the leaf had to be re-inserted
+	bool move(int proxy, const AxisAlignedBox& bounds);
+	// Nearest field hit by the ray, or nullptr
+	ForceField* raycast(const Ray& ray, float* t) const;
+
+	size_t size() const { return mLeaves; }
+
+private:
+	struct Node {
+		vec3 lower, upper;
+		int parent = -1;
+		int left = -1, right = -1;
+		ForceField* field = nullptr;
+
+		bool isLeaf() const { return left == -1; }
+	};
+
+	int allocateNode();
+	void freeNode(int node);
+	void insertLeaf(int leaf);
+	void removeLeaf(int leaf);
+	void refit(int node);
+
+	std::vector<Node> mNodes;
+	std::vector<int> mFreeNodes;
+	int mRoot = -1;
+	size_t mLeaves = 0;
+	const float mMargin = 0.2f; /* Fattening of leaf bounds */
+};
+
+// Single entry point for mouse picking and dragging of force fields.
+// Selection lives here instead of in the fields, so there is exactly one
+// ray test per click no matter how many fields exist.
+class PickingService {
+public:
+	PickingService(CameraPersp* cam);
+	void add(ForceField* ff);
+	void remove(ForceField* ff);
+	// Call when a field changed its bounds outside of a drag
+	void update(ForceField* ff);
+
+	void mouseDown(MouseEvent e);
+	void mouseDrag(MouseEvent e);
+
+	ForceField* getSelected() const { return mSelected; }
+	void setEnabled(bool enabled);
+
+private:
+	void select(ForceField* ff);
+
+	AabbTree mTree;
+	CameraPersp* mCam;
+	ForceField* mSelected = nullptr;
+	int mSelectedHandle = -1;
+	bool mEnabled = true;
+};
@@ -0,0 +1,83 @@
+#include "QualityGovernor.h"
+
+// The cloth advances the same simulated time per frame at every level, fewer
+// iterations take larger steps. Below 10 the steps get too large for its springs.
+const QualityLevel QualityGovernor::sLevels[] = {
+	{ 0.25f, 10, 2.0f, QuarterResolution },
+	{ 0.5f, 12, 3.0f, HalfResolution },
+	{ 0.75f, 15, 4.0f, FullResolution },
+	{ 1.0f, 20, 5.0f, FullResolution },
+};
+const int QualityGovernor::sNumLevels = sizeof(sLevels) / sizeof(sLevels[0]);
+
+QualityGovernor::QualityGovernor()
+{
+	mLevel = sNumLevels - 1;
+	mGpuTimer = gl::QueryTimeSwapped::create();
+	getWindow()->getApp()->getSignalUpdate().connect(std::bind(&QualityGovernor::beginFrame, this));
+}
+
+void QualityGovernor::attach(ParticleManager* pm, ClothSimulator* cs)
+{
+	mPm = pm;
+	mCs = cs;
+	apply();
+}
+
+void QualityGovernor::beginFrame()
+{
+	mFrameStart = getElapsedSeconds();
+	mGpuTimer->begin();
+}
+
+void QualityGovernor::endFrame()
+{
+	mGpuTimer->end();
+	float cpu = float(getElapsedSeconds() - mFrameStart) * 1000.0f;
+	// The swapped query returns the result of the previous frame, which
+	// does not exist yet on the very first one
+	float gpu = mFramesMeasured > 0 ? float(mGpuTimer->getElapsedMilliseconds()) : 0.0f;
+	++mFramesMeasured;
+
+	// Exponential smoothing, so single spikes don't count as a missed budget
+	const float alpha = 0.1f;
+	mCpuTime += (cpu - mCpuTime) * alpha;
+	mGpuTime += (gpu - mGpuTime) * alpha;
+	mFrameTime = std::max(mCpuTime, mGpuTime);
+
+	if (!mEnabled || !mPm || !mCs) return;
+	if (mCooldown > 0) {
+		--mCooldown;
+		return;
+	}
+
+	mFramesOver = mFrameTime > mTargetFrameTime * mDownThreshold ? mFramesOver + 1 : 0;
+	mFramesUnder = mFrameTime < mTargetFrameTime * mUpThreshold ? mFramesUnder + 1 : 0;
+
+	int level = mLevel;
+	if (mFramesOver >= mDownFrames && mLevel > 0)
+		--level;
+	else if (mFramesUnder >= mUpFrames && mLevel < sNumLevels - 1)
+		++level;
+
+	if (level != mLevel) {
+		mLevel = level;
+		mFramesOver = mFramesUnder = 0;
+		mCooldown = mCooldownFrames;
+		apply();
+	}
+}
+
+void QualityGovernor::apply()
+{
+	const QualityLevel& l = sLevels[mLevel];
+	mActiveParticles = std::max(1, int(mPm->getMaxParticles() * l.particleFraction));
+	mClothIterations = int(l.clothIterations);
+	mPointSize = l.pointSize;
+	mRenderResolution = l.renderResolution;
+
+	mPm->setActiveParticles(mActiveParticles);
+	mPm->mPointSize = mPointSize;
+	mPm->mRenderResolution = mRenderResolution;
+	mCs->setIterationsPerFrame(l.clothIterations);
+}
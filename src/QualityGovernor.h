@@ -0,0 +1,62 @@
+#pragma once
+#include "cinder/app/App.h"
+#include "cinder/gl/gl.h"
+#include "cinder/gl/Query.h"
+#include "Particles.h"
+#include "Cloth.h"
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+// One step on the quality ladder, from cheapest to most expensive
+struct QualityLevel {
+	float particleFraction;	// Share of the particle pool that is simulated and drawn
+	uint32_t clothIterations;	// Cloth solver iterations per frame
+	float pointSize;		// Particle point size in pixels
+	int renderResolution;	// ParticleResolution the particles are drawn at
+};
+
+class QualityGovernor {
+public:
+	// Has to be created before any other system connects to the update signal,
+	// so that beginFrame runs first and the measurement covers the whole frame.
+	QualityGovernor();
+	void attach(ParticleManager* pm, ClothSimulator* cs);
+	void beginFrame();
+	void endFrame();
+
+	bool mEnabled = true;
+	float mTargetFrameTime = 16.6f; /* Frame-time budget in milliseconds */
+
+	// Current state, exposed for the params panel
+	float mFrameTime = 0.0f;	/* Smoothed max(cpu, gpu) frame time in milliseconds */
+	float mCpuTime = 0.0f, mGpuTime = 0.0f;
+	int mLevel;
+	int mActiveParticles = 0;
+	int mClothIterations = 0;
+	float mPointSize = 0.0f;
+	int mRenderResolution = FullResolution;
+
+private:
+	void apply();
+
+	static const QualityLevel sLevels[];
+	static const int sNumLevels;
+
+	ParticleManager* mPm = nullptr;
+	ClothSimulator* mCs = nullptr;
+	gl::QueryTimeSwappedRef mGpuTimer;
+	double mFrameStart = 0.0;
+	uint32_t mFramesMeasured = 0;
+
+	// Hysteresis: the budget has to be missed (or undercut) for a number of
+	// consecutive frames before the level changes, and every change is followed
+	// by a cooldown so the new level can settle before it is judged.
+	int mFramesOver = 0, mFramesUnder = 0, mCooldown = 0;
+	const float mDownThreshold = 1.1f;	/* Step down when above 110% of the budget */
+	const float mUpThreshold = 0.75f;	/* Step up when below 75% of the budget */
+	const int mDownFrames = 10;
+	const int mUpFrames = 60;
+	const int mCooldownFrames = 30;
+};
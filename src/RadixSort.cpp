@@ -0,0 +1,133 @@
+#include "RadixSort.h"
+
+namespace {
+
+GLuint numBlocks(int count)
+{
+	return GLuint((count + RadixSort::BLOCK_SIZE - 1) / RadixSort::BLOCK_SIZE);
+}
+
+GLuint numTiles(int size)
+{
+	return GLuint((size + RadixSort::SCAN_TILE_SIZE - 1) / RadixSort::SCAN_TILE_SIZE);
+}
+
+}
+
+bool RadixSort::isSupported()
+{
+	return gl::isExtensionAvailable("GL_ARB_compute_shader") && gl::isExtensionAvailable("GL_ARB_shader_storage_buffer_object");
+}
+
+RadixSort::RadixSort()
+{
+	mCountProg = gl::GlslProg::create(gl::GlslProg::Format().compute(loadAsset("radixCount.comp")));
+	mScanProg = gl::GlslProg::create(gl::GlslProg::Format().compute(loadAsset("radixScan.comp")));
+	mScanAddProg = gl::GlslProg::create(gl::GlslProg::Format().compute(loadAsset("radixScanAdd.comp")));
+	mScatterProg = gl::GlslProg::create(gl::GlslProg::Format().compute(loadAsset("radixScatter.comp")));
+	mGatherProg = gl::GlslProg::create(gl::GlslProg::Format().compute(loadAsset("sortGather.comp")));
+}
+
+void RadixSort::reserve(int count)
+{
+	if (count <= mCapacity) return;
+	mCapacity = count;
+	mKeys = gl::BufferObj::create(GL_SHADER_STORAGE_BUFFER, count * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+	mValues = gl::BufferObj::create(GL_SHADER_STORAGE_BUFFER, count * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+	mHistograms = gl::BufferObj::create(GL_SHADER_STORAGE_BUFFER, 16 * numBlocks(count) * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+
+	// Every level holds the totals of the tiles of the level below, up to a single tile
+	mTileSums.clear();
+	int size = 16 * int(numBlocks(count));
+	do {
+		size = int(numTiles(size));
+		mTileSums.push_back(gl::BufferObj::create(GL_SHADER_STORAGE_BUFFER, size * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY));
+	} while (size > 1);
+}
+
+void RadixSort::scan(const gl::BufferObjRef& data, int size, size_t level)
+{
+	GLuint tiles = numTiles(size);
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, data);
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, mTileSums[level]);
+	{
+		gl::ScopedGlslProg progScope(mScanProg);
+		mScanProg->uniform("Size", size);
+		gl::dispatchCompute(tiles);
+	}
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	if (tiles <= 1) return;
+
+	scan(mTileSums[level], int(tiles), level + 1);
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, data);
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, mTileSums[level]);
+	{
+		gl::ScopedGlslProg progScope(mScanAddProg);
+		mScanAddProg->uniform("Size", size);
+		gl::dispatchCompute(tiles);
+	}
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void RadixSort::sort(const gl::BufferObjRef& keys, const gl::BufferObjRef& values, int count, int keyBits)
+{
+	if (count <= 0) return;
+	reserve(count);
+	GLuint blocks = numBlocks(count);
+	int passes = (keyBits + 3) / 4;
+
+	gl::BufferObjRef srcKeys = keys, srcValues = values, dstKeys = mKeys, dstValues = mValues;
+	for (int pass = 0; pass < passes; ++pass) {
+		int shift = pass * 4;
+		gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, srcKeys);
+		gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, srcValues);
+		gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, mHistograms);
+		gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, dstKeys);
+		gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, dstValues);
+
+		{
+			gl::ScopedGlslProg progScope(mCountProg);
+			mCountProg->uniform("Count", count);
+			mCountProg->uniform("Shift", shift);
+			gl::dispatchCompute(blocks);
+		}
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		scan(mHistograms, int(16 * blocks), 0);
+		{
+			gl::ScopedGlslProg progScope(mScatterProg);
+			mScatterProg->uniform("Count", count);
+			mScatterProg->uniform("Shift", shift);
+			gl::dispatchCompute(blocks);
+		}
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		std::swap(srcKeys, dstKeys);
+		std::swap(srcValues, dstValues);
+	}
+
+	// After an odd number of passes the result is in the scratch buffers
+	if (passes & 1) {
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		copyBuffer(mKeys, keys, count * sizeof(GLuint));
+		copyBuffer(mValues, values, count * sizeof(GLuint));
+	}
+}
+
+void RadixSort::gather(const gl::BufferObjRef& values, const gl::BufferObjRef& src, const gl::BufferObjRef& dst, int count, int components)
+{
+	gl::ScopedGlslProg progScope(mGatherProg);
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, values);
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, src);
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, dst);
+	mGatherProg->uniform("Count", count);
+	mGatherProg->uniform("Components", components);
+	gl::dispatchCompute(numBlocks(count));
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+void copyBuffer(const gl::BufferObjRef& src, const gl::BufferObjRef& dst, GLsizeiptr size)
+{
+	gl::ScopedBuffer readScope(GL_COPY_READ_BUFFER, src->getId());
+	gl::ScopedBuffer writeScope(GL_COPY_WRITE_BUFFER, dst->getId());
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "cinder/app/App.h"
+#include "cinder/gl/gl.h"
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+// Stable least significant digit radix sort of 32 bit key/value pairs on the
+// GPU, four bits per pass. Every pass counts the digits per block of 256 keys,
+// scans the counts of all blocks into global offsets, and scatters the pairs
+// with their rank inside the block. The scan runs over tiles of 4096 counts in
+// parallel, then scans the tile totals the same way and adds them back, so no
+// pass is limited to a single work group. Needs compute shaders (GL 4.3).
+class RadixSort {
+public:
+	static bool isSupported();
+
+	RadixSort();
+	// Sorts count pairs in place by the lowest keyBits bits of the keys
+	void sort(const gl::BufferObjRef& keys, const gl::BufferObjRef& values, int count, int keyBits);
+	// Applies a permutation of values from sort to an array of count elements,
+	// with components 32 bit words each: dst[i] = src[values[i]]
+	void gather(const gl::BufferObjRef& values, const gl::BufferObjRef& src, const gl::BufferObjRef& dst, int count, int components);
+
+	static const int BLOCK_SIZE = 256;
+	static const int SCAN_TILE_SIZE = 4096;
+
+private:
+	void reserve(int count);
+	// Exclusive prefix sum of size entries of data, using the tile sums of level and above
+	void scan(const gl::BufferObjRef& data, int size, size_t level);
+
+	gl::GlslProgRef mCountProg, mScanProg, mScanAddProg, mScatterProg, mGatherProg;
+	gl::BufferObjRef mKeys, mValues; /* Ping-pong partners of the sorted buffers */
+	gl::BufferObjRef mHistograms; /* 16 digit counts per block, digit major */
+	vector<gl::BufferObjRef> mTileSums; /* Totals of the scan tiles, one buffer per level */
+	int mCapacity = 0;
+};
+
+// Copies size bytes between two buffers on the GPU
+void copyBuffer(const gl::BufferObjRef& src, const gl::BufferObjRef& dst, GLsizeiptr size);
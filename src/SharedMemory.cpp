@@ -0,0 +1,104 @@
+#include "SharedMemory.h"
+
+#if defined( CINDER_MSW )
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined( CINDER_MSW )
+
+SharedMemory* SharedMemory::create(const std::string& name, size_t size)
+{
+	HANDLE handle = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+		DWORD(uint64_t(size) >> 32), DWORD(size & 0xFFFFFFFF), name.c_str());
+	if (!handle) return nullptr;
+	// Like O_EXCL on POSIX, never attach to a mapping someone else created
+	if (GetLastError() == ERROR_ALREADY_EXISTS) {
+		CloseHandle(handle);
+		return nullptr;
+	}
+	void* data = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (!data) {
+		CloseHandle(handle);
+		return nullptr;
+	}
+	SharedMemory* memory = new SharedMemory();
+	memory->mName = name;
+	memory->mHandle = handle;
+	memory->mData = data;
+	memory->mSize = size;
+	memory->mOwner = true;
+	return memory;
+}
+
+SharedMemory* SharedMemory::open(const std::string& name)
+{
+	HANDLE handle = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+	if (!handle) return nullptr;
+	void* data = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (!data) {
+		CloseHandle(handle);
+		return nullptr;
+	}
+	MEMORY_BASIC_INFORMATION info;
+	VirtualQuery(data, &info, sizeof(info));
+	SharedMemory* memory = new SharedMemory();
+	memory->mName = name;
+	memory->mHandle = handle;
+	memory->mData = data;
+	memory->mSize = info.RegionSize;
+	return memory;
+}
+
+SharedMemory::~SharedMemory()
+{
+	if (mData) UnmapViewOfFile(mData);
+	if (mHandle) CloseHandle(mHandle);
+}
+
+#else
+
+SharedMemory* SharedMemory::create(const std::string& name, size_t size)
+{
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd == -1) return nullptr;
+	void* data = ftruncate(fd, off_t(size)) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data == MAP_FAILED) {
+		shm_unlink(name.c_str());
+		return nullptr;
+	}
+	SharedMemory* memory = new SharedMemory();
+	memory->mName = name;
+	memory->mData = data;
+	memory->mSize = size;
+	memory->mOwner = true;
+	return memory;
+}
+
+SharedMemory* SharedMemory::open(const std::string& name)
+{
+	int fd = shm_open(name.c_str(), O_RDWR, 0600);
+	if (fd == -1) return nullptr;
+	struct stat info;
+	void* data = fstat(fd, &info) == 0 ? mmap(nullptr, size_t(info.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data == MAP_FAILED) return nullptr;
+	SharedMemory* memory = new SharedMemory();
+	memory->mName = name;
+	memory->mData = data;
+	memory->mSize = size_t(info.st_size);
+	return memory;
+}
+
+SharedMemory::~SharedMemory()
+{
+	if (mData) munmap(mData, mSize);
+	if (mOwner) shm_unlink(mName.c_str());
+}
+
+#endif
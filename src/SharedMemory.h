@@ -0,0 +1,28 @@
+#pragma once
+#include "cinder/Cinder.h"
+#include "cinder/Noncopyable.h"
+#include <string>
+
+// A named region of memory shared between processes. The creator sizes the
+// region and fails if the name is taken, other processes open it by name and
+// map all of it.
+class SharedMemory : private ci::Noncopyable {
+public:
+	static SharedMemory* create(const std::string& name, size_t size);
+	static SharedMemory* open(const std::string& name);
+	~SharedMemory();
+
+	void* getData() const { return mData; }
+	size_t getSize() const { return mSize; }
+
+private:
+	SharedMemory() {}
+
+	std::string mName;
+	void* mData = nullptr;
+	size_t mSize = 0;
+	bool mOwner = false;
+#if defined( CINDER_MSW )
+	void* mHandle = nullptr;
+#endif
+};
@@ -0,0 +1,181 @@
+#include "SignedDistanceField.h"
+#include <algorithm>
+#include <limits>
+
+namespace {
+
+struct Triangle {
+	vec3 a, b, c;
+	vec3 lower, upper;
+};
+
+// Squared distance from p to a box, a lower bound for any point inside it
+float boxDistance2(const vec3& p, const vec3& lower, const vec3& upper)
+{
+	vec3 d = glm::max(glm::max(lower - p, p - upper), vec3(0.0f));
+	return dot(d, d);
+}
+
+// Closest point on triangle abc to p, from Ericson's Real-Time Collision Detection
+vec3 closestPointOnTriangle(const vec3& p, const vec3& a, const vec3& b, const vec3& c)
+{
+	vec3 ab = b - a, ac = c - a, ap = p - a;
+	float d1 = dot(ab, ap), d2 = dot(ac, ap);
+	if (d1 <= 0.0f && d2 <= 0.0f) return a;
+
+	vec3 bp = p - b;
+	float d3 = dot(ab, bp), d4 = dot(ac, bp);
+	if (d3 >= 0.0f && d4 <= d3) return b;
+
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+
+	vec3 cp = p - c;
+	float d5 = dot(ab, cp), d6 = dot(ac, cp);
+	if (d6 >= 0.0f && d5 <= d6) return c;
+
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+		return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+	float denom = 1.0f / (va + vb + vc);
+	return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// Casts one ray along the given axis through every texel row and counts the
+// surface crossings in front of each texel. Odd counts vote for "inside".
+void voteInside(const std::vector<Triangle>& triangles, const AxisAlignedBox& bounds, ivec3 res, int axis, std::vector<int>& votes)
+{
+	int u = (axis + 1) % 3, v = (axis + 2) % 3;
+	vec3 cell = bounds.getSize() / vec3(res);
+	vec3 origin = bounds.getMin() + cell * 0.5f;
+
+	// Crossing coordinates along the axis, per (u, v) row
+	std::vector<std::vector<float>> rows(res[u] * res[v]);
+	for (const Triangle& t : triangles) {
+		vec2 a(t.a[u], t.a[v]), b(t.b[u], t.b[v]), c(t.c[u], t.c[v]);
+		float area = (b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y);
+		if (std::abs(area) < 1e-12f) continue; // parallel to the ray
+
+		vec2 lo = glm::min(a, glm::min(b, c)), hi = glm::max(a, glm::max(b, c));
+		int iu0 = std::max(0, int(std::ceil((lo.x - origin[u]) / cell[u])));
+		int iu1 = std::min(res[u] - 1, int(std::floor((hi.x - origin[u]) / cell[u])));
+		int iv0 = std::max(0, int(std::ceil((lo.y - origin[v]) / cell[v])));
+		int iv1 = std::min(res[v] - 1, int(std::floor((hi.y - origin[v]) / cell[v])));
+
+		for (int iv = iv0; iv <= iv1; ++iv) {
+			for (int iu = iu0; iu <= iu1; ++iu) {
+				vec2 p(origin[u] + iu * cell[u], origin[v] + iv * cell[v]);
+				// Barycentric coordinates of the row in the projected triangle
+				float w0 = ((b.x - p.x) * (c.y - p.y) - (c.x - p.x) * (b.y - p.y)) / area;
+				float w1 = ((c.x - p.x) * (a.y - p.y) - (a.x - p.x) * (c.y - p.y)) / area;
+				float w2 = 1.0f - w0 - w1;
+				if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f) continue;
+				rows[iu + iv * res[u]].push_back(w0 * t.a[axis] + w1 * t.b[axis] + w2 * t.c[axis]);
+			}
+		}
+	}
+
+	for (int iv = 0; iv < res[v]; ++iv) {
+		for (int iu = 0; iu < res[u]; ++iu) {
+			std::vector<float>& crossings = rows[iu + iv * res[u]];
+			std::sort(crossings.begin(), crossings.end());
+			size_t passed = 0;
+			for (int ia = 0; ia < res[axis]; ++ia) {
+				float x = origin[axis] + ia * cell[axis];
+				while (passed < crossings.size() && crossings[passed] < x) ++passed;
+				if (passed & 1) {
+					ivec3 idx;
+					idx[axis] = ia; idx[u] = iu; idx[v] = iv;
+					++votes[idx.x + res.x * (idx.y + res.y * idx.z)];
+				}
+			}
+		}
+	}
+}
+
+}
+
+std::vector<vec4> bakeSignedDistanceField(const TriMesh& mesh, const AxisAlignedBox& bounds, ivec3 res,
+	const std::atomic<bool>* cancel)
+{
+	std::vector<Triangle> triangles(mesh.getNumTriangles());
+	for (size_t i = 0; i < triangles.size(); ++i) {
+		Triangle& t = triangles[i];
+		mesh.getTriangleVertices(i, &t.a, &t.b, &t.c);
+		t.lower = glm::min(t.a, glm::min(t.b, t.c));
+		t.upper = glm::max(t.a, glm::max(t.b, t.c));
+	}
+
+	const int count = res.x * res.y * res.z;
+	std::vector<int> votes(count, 0);
+	for (int axis = 0; axis < 3; ++axis)
+		voteInside(triangles, bounds, res, axis, votes);
+
+	vec3 cell = bounds.getSize() / vec3(res);
+	vec3 origin = bounds.getMin() + cell * 0.5f;
+	std::vector<float> distances(count);
+	size_t nearest = 0, closest = 0;
+	for (int z = 0; z < res.z; ++z) {
+		if (cancel && cancel->load(std::memory_order_relaxed)) return {};
+		for (int y = 0; y < res.y; ++y) {
+			for (int x = 0; x < res.x; ++x) {
+				int i = x + res.x * (y + res.y * z);
+				vec3 p = origin + vec3(x, y, z) * cell;
+				float best = std::numeric_limits<float>::max();
+				for (size_t k = 0; k < triangles.size(); ++k) {
+					// Start with the nearest triangle of the previous texel, so the
+					// bounds test below rejects most of the others right away
+					const Triangle& t = triangles[(k + nearest) % triangles.size()];
+					if (boxDistance2(p, t.lower, t.upper) >= best) continue;
+					vec3 d = p - closestPointOnTriangle(p, t.a, t.b, t.c);
+					if (dot(d, d) < best) {
+						best = dot(d, d);
+						closest = (k + nearest) % triangles.size();
+					}
+				}
+				nearest = closest;
+				distances[i] = votes[i] >= 2 ? -std::sqrt(best) : std::sqrt(best);
+			}
+		}
+	}
+
+	// Central differences give the direction out of the surface
+	auto at = [&](int x, int y, int z) {
+		x = glm::clamp(x, 0, res.x - 1);
+		y = glm::clamp(y, 0, res.y - 1);
+		z = glm::clamp(z, 0, res.z - 1);
+		return distances[x + res.x * (y + res.y * z)];
+	};
+	std::vector<vec4> field(count);
+	for (int z = 0; z < res.z; ++z) {
+		for (int y = 0; y < res.y; ++y) {
+			for (int x = 0; x < res.x; ++x) {
+				vec3 gradient((at(x + 1, y, z) - at(x - 1, y, z)) / cell.x,
+					(at(x, y + 1, z) - at(x, y - 1, z)) / cell.y,
+					(at(x, y, z + 1) - at(x, y, z - 1)) / cell.z);
+				float len = length(gradient);
+				int i = x + res.x * (y + res.y * z);
+				field[i] = vec4(len > 0.0f ? gradient / len : vec3(0, 1, 0), distances[i]);
+			}
+		}
+	}
+	return field;
+}
+
+gl::Texture3dRef createSignedDistanceTexture(const std::vector<vec4>& field, ivec3 res)
+{
+	gl::Texture3d::Format format;
+	format.internalFormat(GL_RGBA16F);
+	format.wrap(GL_CLAMP_TO_EDGE);
+	format.minFilter(GL_LINEAR);
+	format.magFilter(GL_LINEAR);
+	gl::Texture3dRef texture = gl::Texture3d::create(res.x, res.y, res.z, format);
+
+	gl::ScopedTextureBind scopeTex(texture);
+	glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, res.x, res.y, res.z, GL_RGBA, GL_FLOAT, field.data());
+	return texture;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include "cinder/app/App.h"
+#include "cinder/gl/gl.h"
+#include "cinder/TriMesh.h"
+#include "cinder/AxisAlignedBox.h"
+#include <atomic>
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+// Samples the signed distance to a triangle mesh at the texel centers of a regular
+// grid spanning bounds. Each texel holds the normalized gradient (the surface normal
+// near the surface) in xyz and the distance in w, negative inside the mesh.
+// The inside test is a majority vote of ray parities along the three axes, so
+// meshes with small holes (like the teapot) still get a usable sign.
+// Takes seconds for dense meshes, so it is meant to run off the main thread.
+// Setting cancel stops the bake within a slice, it then returns an empty field.
+std::vector<vec4> bakeSignedDistanceField(const TriMesh& mesh, const AxisAlignedBox& bounds, ivec3 resolution,
+	const std::atomic<bool>* cancel = nullptr);
+
+// Uploads a baked field into a linearly filtered RGBA16F 3d texture
+gl::Texture3dRef createSignedDistanceTexture(const std::vector<vec4>& field, ivec3 resolution);
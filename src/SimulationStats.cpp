@@ -0,0 +1,128 @@
+#include "SimulationStats.h"
+#include "RadixSort.h"
+#include <cmath>
+
+namespace {
+
+const int GROUP_SIZE = 256;
+
+int numGroups(int count)
+{
+	return (count + GROUP_SIZE - 1) / GROUP_SIZE;
+}
+
+}
+
+SimulationStats::SimulationStats()
+{
+	if (!RadixSort::isSupported()) {
+		mEnabled = false;
+		return;
+	}
+	mReduceProg = gl::GlslProg::create(gl::GlslProg::Format().compute(loadAsset("reduceStats.comp")));
+	for (Slot& slot : mSlots)
+		slot.results = gl::BufferObj::create(GL_SHADER_STORAGE_BUFFER, 2 * sizeof(Stats), nullptr, GL_STREAM_READ);
+}
+
+void SimulationStats::attach(ParticleManager* pm, ClothSimulator* cs)
+{
+	mPm = pm;
+	mCs = cs;
+}
+
+void SimulationStats::update()
+{
+	if (!mEnabled || !mReduceProg || !mPm || !mCs) return;
+
+	// Collect every result whose fence has passed, oldest first. mNextSlot is the
+	// oldest one in flight, and since fences pass in order the first one that
+	// hasn't passed means no newer one has either.
+	for (int i = 0; i < NUM_SLOTS; ++i) {
+		Slot& slot = mSlots[(mNextSlot + i) % NUM_SLOTS];
+		if (!slot.fence) continue;
+		if (glClientWaitSync(slot.fence, 0, 0) == GL_TIMEOUT_EXPIRED) break;
+		glDeleteSync(slot.fence);
+		slot.fence = nullptr;
+
+		Stats results[2];
+		gl::ScopedBuffer scopeBuffer(slot.results);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(results), results);
+		mLatency = int(getElapsedFrames() - slot.frame);
+		publish(results);
+	}
+
+	Slot& slot = mSlots[mNextSlot];
+	if (slot.fence) return; // The GPU is too far behind, skip a frame rather than wait
+
+	int partials = numGroups(std::max(mPm->getMaxParticles(), int(POINTS_TOTAL)));
+	if (partials > mPartialCapacity) {
+		mPartialCapacity = partials;
+		for (auto& buffer : mPartials)
+			buffer = gl::BufferObj::create(GL_SHADER_STORAGE_BUFFER, partials * sizeof(Stats), nullptr, GL_DYNAMIC_COPY);
+	}
+
+	gl::ScopedGlslProg progScope(mReduceProg);
+	mReduceProg->uniform("Time", mPm->getSimulationTime());
+	mReduceProg->uniform("RestLength", CLOTH_REST_LENGTH);
+
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, mPm->getPositions());
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, mPm->getVelocities());
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, mPm->getStartTimes());
+	reduce(0, mPm->getMaxParticles(), 0);
+
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, mCs->getPositions());
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, mCs->getVelocities());
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, mCs->getConnections());
+	reduce(1, POINTS_TOTAL, 1);
+
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.frame = getElapsedFrames();
+	mNextSlot = (mNextSlot + 1) % NUM_SLOTS;
+}
+
+void SimulationStats::reduce(int mode, int count, int resultOffset)
+{
+	// The first pass folds the elements into one partial result per group,
+	// every further pass folds the partial results until one is left
+	int groups = numGroups(count);
+	int source = 0;
+	mReduceProg->uniform("Mode", mode);
+	mReduceProg->uniform("Count", count);
+	mReduceProg->uniform("ResultOffset", groups > 1 ? 0 : resultOffset);
+	gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, groups > 1 ? mPartials[source] : mSlots[mNextSlot].results);
+	gl::dispatchCompute(GLuint(groups));
+
+	while (groups > 1) {
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		count = groups;
+		groups = numGroups(count);
+		mReduceProg->uniform("Mode", 2);
+		mReduceProg->uniform("Count", count);
+		mReduceProg->uniform("ResultOffset", groups > 1 ? 0 : resultOffset);
+		gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, mPartials[source]);
+		gl::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, groups > 1 ? mPartials[1 - source] : mSlots[mNextSlot].results);
+		gl::dispatchCompute(GLuint(groups));
+		source = 1 - source;
+	}
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+void SimulationStats::publish(const Stats* results)
+{
+	SimulationSummary* summaries[2] = { &mParticles, &mCloth };
+	for (int i = 0; i < 2; ++i) {
+		const Stats& s = results[i];
+		SimulationSummary& summary = *summaries[i];
+		summary.count = int(s.lower.w);
+		bool empty = summary.count == 0;
+		summary.boundsMin = empty ? vec3(0) : vec3(s.lower);
+		summary.boundsMax = empty ? vec3(0) : vec3(s.upper);
+		summary.maxStretch = s.upper.w;
+		summary.meanSpeed = empty ? 0.0f : s.motion.x / summary.count;
+		summary.maxSpeed = s.motion.y;
+		summary.kineticEnergy = s.motion.z;
+	}
+	mUnstable = !std::isfinite(mParticles.kineticEnergy) || !std::isfinite(mCloth.kineticEnergy)
+		|| mParticles.maxSpeed > mMaxStableSpeed || mCloth.maxSpeed > mMaxStableSpeed;
+	mValid = true;
+}
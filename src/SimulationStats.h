@@ -0,0 +1,62 @@
+#pragma once
+#include "cinder/app/App.h"
+#include "cinder/gl/gl.h"
+#include "Particles.h"
+#include "Cloth.h"
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+// Aggregate state of one simulation, as reduced on the GPU
+struct SimulationSummary {
+	int count = 0; /* Alive particles, or cloth nodes */
+	vec3 boundsMin = vec3(0), boundsMax = vec3(0);
+	float meanSpeed = 0.0f, maxSpeed = 0.0f;
+	float kineticEnergy = 0.0f; /* Particles count with unit mass */
+	float maxStretch = 0.0f; /* Relative to the rest length, cloth only */
+};
+
+// Reduces particle and cloth state on the GPU after both were updated. Only
+// the final two results are read back, a few frames later, once their fence
+// has passed, so the CPU never waits for the GPU. If all readback slots are
+// still in flight a frame is skipped instead. Needs compute shaders (GL 4.3).
+class SimulationStats {
+public:
+	SimulationStats();
+	void attach(ParticleManager* pm, ClothSimulator* cs);
+	// Call once per frame after the simulations were updated
+	void update();
+
+	bool mEnabled = true;
+	float mMaxStableSpeed = 100.0f; /* Faster particles or nodes count as unstable */
+
+	// Latest results, exposed for the params panel
+	SimulationSummary mParticles, mCloth;
+	int mLatency = 0; /* Frames between the reduction and its readback */
+	bool mUnstable = false; /* Non-finite or excessive speeds were seen */
+	bool mValid = false; /* At least one result has arrived */
+
+private:
+	struct Stats {
+		vec4 lower, upper, motion;
+	};
+
+	void reduce(int mode, int count, int resultOffset);
+	void publish(const Stats* results);
+
+	static const int NUM_SLOTS = 3;
+	struct Slot {
+		gl::BufferObjRef results;
+		GLsync fence = nullptr;
+		uint32_t frame = 0;
+	};
+
+	ParticleManager* mPm = nullptr;
+	ClothSimulator* mCs = nullptr;
+	gl::GlslProgRef mReduceProg;
+	gl::BufferObjRef mPartials[2];
+	int mPartialCapacity = 0;
+	Slot mSlots[NUM_SLOTS];
+	int mNextSlot = 0;
+};
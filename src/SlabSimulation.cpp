@@ -0,0 +1,375 @@
+#include "SlabSimulation.h"
+#include "cinder/Log.h"
+#include "cinder/Rand.h"
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include <thread>
+
+#if defined( CINDER_MSW )
+#include <windows.h>
+#else
+#include <signal.h>
+#include <spawn.h>
+#if defined( __linux__ )
+#include <sys/prctl.h>
+#endif
+#include <sys/wait.h>
+#include <unistd.h>
+extern char** environ;
+#endif
+
+namespace {
+
+const uint32_t SLAB_MAGIC = 0x534c4142;
+int sNextInstance = 0; /* Keeps the shared memory names of restarted simulations apart */
+
+size_t alignUp(size_t size) { return (size + 63) & ~size_t(63); }
+
+size_t slabStride(int capacity)
+{
+	return alignUp(sizeof(SlabState)) + alignUp(capacity * sizeof(SlabParticle));
+}
+
+SlabHeader* getHeader(void* memory) { return static_cast<SlabHeader*>(memory); }
+
+SlabState* getSlab(void* memory, int index)
+{
+	char* base = static_cast<char*>(memory) + alignUp(sizeof(SlabHeader));
+	return reinterpret_cast<SlabState*>(base + index * slabStride(getHeader(memory)->capacity));
+}
+
+SlabParticle* getParticles(SlabState* slab)
+{
+	return reinterpret_cast<SlabParticle*>(reinterpret_cast<char*>(slab) + alignUp(sizeof(SlabState)));
+}
+
+int getProcessId()
+{
+#if defined( CINDER_MSW )
+	return int(GetCurrentProcessId());
+#else
+	return int(getpid());
+#endif
+}
+
+std::string getExecutablePath()
+{
+#if defined( CINDER_MSW )
+	char path[MAX_PATH];
+	GetModuleFileNameA(nullptr, path, MAX_PATH);
+	return path;
+#else
+	char path[4096];
+	ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	return std::string(path, length > 0 ? size_t(length) : 0);
+#endif
+}
+
+// Workers are tied to the coordinator: on Windows by its job object, elsewhere
+// they notice being reparented once it has exited or crashed
+bool isCoordinatorAlive(const SlabHeader* header)
+{
+#if defined( CINDER_MSW )
+	(void)header;
+	return true;
+#else
+	return getppid() == pid_t(header->coordinator);
+#endif
+}
+
+// First half of a step: integrate, hand off the particles that left to the neighbours
+void stepSlab(void* memory, int index)
+{
+	SlabHeader* header = getHeader(memory);
+	SlabState* slab = getSlab(memory, index);
+	SlabParticle* particles = getParticles(slab);
+	SlabState* lower = index > 0 ? getSlab(memory, index - 1) : nullptr;
+	SlabState* upper = index < header->numSlabs - 1 ? getSlab(memory, index + 1) : nullptr;
+
+	float width = (header->domainMax.x - header->domainMin.x) / header->numSlabs;
+	float slabMin = header->domainMin.x + index * width;
+	float slabMax = slabMin + width;
+	float h = header->timestep;
+	for (int i = 0; i < slab->count; ) {
+		SlabParticle& q = particles[i];
+		q.velocity /= 1.0f + header->dragCoefficient * length(q.velocity) * h;
+		q.position += q.velocity * h;
+		// The outer walls of the domain reflect, like the cuboid obstacles do on the GPU
+		for (int axis = 0; axis < 3; ++axis) {
+			if (q.position[axis] < header->domainMin[axis]) {
+				q.position[axis] = header->domainMin[axis];
+				q.velocity[axis] = -q.velocity[axis] * header->bounciness;
+			}
+			else if (q.position[axis] > header->domainMax[axis]) {
+				q.position[axis] = header->domainMax[axis];
+				q.velocity[axis] = -q.velocity[axis] * header->bounciness;
+			}
+		}
+
+		// A full queue keeps the particle here for another step
+		bool migrated = false;
+		if (lower && q.position.x < slabMin) migrated = slab->toLower.push(q);
+		else if (upper && q.position.x >= slabMax) migrated = slab->toUpper.push(q);
+		if (migrated) q = particles[--slab->count];
+		else ++i;
+	}
+}
+
+// Second half of a step, once both neighbours have queued their migrants. A
+// slab only leaves particles in the queue, where they aren't drawn, when it is full.
+void receiveMigrants(void* memory, int index)
+{
+	SlabHeader* header = getHeader(memory);
+	SlabState* slab = getSlab(memory, index);
+	SlabParticle* particles = getParticles(slab);
+	SlabState* lower = index > 0 ? getSlab(memory, index - 1) : nullptr;
+	SlabState* upper = index < header->numSlabs - 1 ? getSlab(memory, index + 1) : nullptr;
+
+	SlabParticle p;
+	while (lower && slab->count < header->capacity && lower->toUpper.pop(&p)) particles[slab->count++] = p;
+	while (upper && slab->count < header->capacity && upper->toLower.pop(&p)) particles[slab->count++] = p;
+}
+
+bool hasMigrated(SlabState* slab, uint32_t step)
+{
+	return !slab || slab->migratedStep.load(std::memory_order_acquire) == step;
+}
+
+}
+
+SlabSimulation::SlabSimulation(int numSlabs, int particlesPerSlab, const AxisAlignedBox& domain, const std::vector<SlabParticle>& seed)
+{
+	mNumSlabs = numSlabs;
+#if defined( CINDER_MSW )
+	mName = "Local\\ParticlesSlabs" + std::to_string(getProcessId()) + "_" + std::to_string(sNextInstance++);
+#else
+	mName = "/ParticlesSlabs" + std::to_string(getProcessId()) + "_" + std::to_string(sNextInstance++);
+#endif
+	size_t size = alignUp(sizeof(SlabHeader)) + numSlabs * slabStride(particlesPerSlab);
+	mMemory.reset(SharedMemory::create(mName, size));
+	if (!mMemory) {
+		CI_LOG_E("Could not create shared memory " << mName << " of " << size << " bytes");
+		return;
+	}
+
+	void* memory = mMemory->getData();
+	SlabHeader* header = new (memory) SlabHeader();
+	header->magic = SLAB_MAGIC;
+	header->numSlabs = numSlabs;
+	header->capacity = particlesPerSlab;
+	header->domainMin = domain.getMin();
+	header->domainMax = domain.getMax();
+	header->timestep = 1.0f / 60.0f;
+	header->bounciness = 0.8f;
+	header->dragCoefficient = 0.05f;
+	header->requestedStep.store(0);
+	header->stop.store(0);
+	header->coordinator = getProcessId();
+
+	float width = domain.getSize().x / numSlabs;
+	for (int i = 0; i < numSlabs; ++i) {
+		SlabState* slab = new (getSlab(memory, i)) SlabState();
+		slab->migratedStep.store(0);
+		slab->completedStep.store(0);
+		slab->toLower.init();
+		slab->toUpper.init();
+		slab->count = 0;
+	}
+	// Half of every slab is left as room for particles flowing in
+	for (auto& p : seed) {
+		if (!all(greaterThanEqual(p.position, domain.getMin())) || !all(lessThanEqual(p.position, domain.getMax()))) continue;
+		int i = glm::clamp(int((p.position.x - domain.getMin().x) / width), 0, numSlabs - 1);
+		SlabState* slab = getSlab(memory, i);
+		if (slab->count < particlesPerSlab / 2) getParticles(slab)[slab->count++] = p;
+	}
+
+	// Otherwise seed every slab with particles spread over its own part of the box
+	for (int i = 0; i < numSlabs && seed.empty(); ++i) {
+		SlabState* slab = getSlab(memory, i);
+		slab->count = particlesPerSlab / 2;
+		SlabParticle* particles = getParticles(slab);
+		for (int j = 0; j < slab->count; ++j) {
+			vec3 t(randFloat(), randFloat(), randFloat());
+			particles[j].position = domain.getMin() + vec3((i + t.x) * width, t.y * domain.getSize().y, t.z * domain.getSize().z);
+			particles[j].velocity = randVec3() * randFloat(0.5f, 3.0f);
+		}
+	}
+
+#if defined( CINDER_MSW )
+	// Closing the last handle to the job, which happens when this process dies, kills the workers
+	HANDLE job = CreateJobObjectA(nullptr, nullptr);
+	JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {};
+	limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+	if (job) SetInformationJobObject(job, JobObjectExtendedLimitInformation, &limits, sizeof(limits));
+	mJob = job;
+#endif
+	for (int i = 0; i < numSlabs; ++i) {
+		if (!launchWorker(i)) {
+			CI_LOG_E("Could not start slab worker " << i);
+			stopWorkers();
+			mMemory.reset();
+			return;
+		}
+	}
+	for (int i = 0; i < numSlabs; ++i)
+		mFirsts.push_back(i * particlesPerSlab);
+	mCounts.assign(numSlabs, 0);
+
+	// Laid out like the slabs' particle arrays, which are uploaded as they are
+	mVbo = gl::Vbo::create(GL_ARRAY_BUFFER, numSlabs * particlesPerSlab * sizeof(SlabParticle), nullptr, GL_STREAM_DRAW);
+	mVao = gl::Vao::create();
+	gl::ScopedVao vaoScope(mVao);
+	gl::ScopedBuffer bufferScope(mVbo);
+	gl::enableVertexAttribArray(0);
+	gl::vertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(SlabParticle), (const GLvoid*)offsetof(SlabParticle, position));
+
+	mRenderProgRef = gl::GlslProg::create(gl::GlslProg::Format()
+		.vertex(loadAsset("renderParticle.vert"))
+		.fragment(loadAsset("renderParticle.frag"))
+		.attribLocation("VertexPosition", 0)
+		.attribLocation("VertexStartTime", 2));
+}
+
+SlabSimulation::~SlabSimulation()
+{
+	if (mMemory) stopWorkers();
+#if defined( CINDER_MSW )
+	if (mJob) CloseHandle(mJob);
+#endif
+}
+
+void SlabSimulation::stopWorkers()
+{
+	getHeader(mMemory->getData())->stop.store(1, std::memory_order_release);
+	for (intptr_t worker : mWorkers) {
+#if defined( CINDER_MSW )
+		HANDLE process = reinterpret_cast<HANDLE>(worker);
+		if (WaitForSingleObject(process, 2000) != WAIT_OBJECT_0) TerminateProcess(process, 1);
+		CloseHandle(process);
+#else
+		pid_t pid = pid_t(worker);
+		int status;
+		for (int tries = 0; waitpid(pid, &status, WNOHANG) == 0; ++tries) {
+			if (tries == 200) {
+				kill(pid, SIGKILL);
+				waitpid(pid, &status, 0);
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+#endif
+	}
+	mWorkers.clear();
+}
+
+bool SlabSimulation::launchWorker(int index)
+{
+	std::string exe = getExecutablePath();
+	std::string slab = std::to_string(index);
+#if defined( CINDER_MSW )
+	std::string commandLine = "\"" + exe + "\" " SLAB_WORKER_ARG " " + mName + " " + slab;
+	STARTUPINFOA startup = { sizeof(startup) };
+	PROCESS_INFORMATION info;
+	// Started suspended, so it can't run before it belongs to the job
+	if (!CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, FALSE, CREATE_SUSPENDED, nullptr, nullptr, &startup, &info))
+		return false;
+	if (mJob && !AssignProcessToJobObject(mJob, info.hProcess))
+		CI_LOG_W("Slab worker " << index << " could not join the job object");
+	ResumeThread(info.hThread);
+	CloseHandle(info.hThread);
+	mWorkers.push_back(reinterpret_cast<intptr_t>(info.hProcess));
+#else
+	std::string arg = SLAB_WORKER_ARG;
+	char* argv[] = { &exe[0], &arg[0], &mName[0], &slab[0], nullptr };
+	pid_t pid;
+	if (posix_spawn(&pid, exe.c_str(), nullptr, nullptr, argv, environ) != 0)
+		return false;
+	mWorkers.push_back(intptr_t(pid));
+#endif
+	return true;
+}
+
+void SlabSimulation::gather()
+{
+	if (!mMemory || mStepReady) return;
+	void* memory = mMemory->getData();
+	uint32_t requested = getHeader(memory)->requestedStep.load(std::memory_order_relaxed);
+	for (int i = 0; i < mNumSlabs; ++i) {
+		if (getSlab(memory, i)->completedStep.load(std::memory_order_acquire) != requested) {
+			++mPendingFrames;
+			return;
+		}
+	}
+	mCompletedSteps = int(requested);
+	mPendingFrames = 0;
+	mStepReady = true;
+}
+
+void SlabSimulation::draw()
+{
+	if (!mMemory) return;
+	if (mStepReady) {
+		// Every worker is idle until the next request, so each slab's particles
+		// go to the vbo straight from the shared memory, in one copy per slab
+		void* memory = mMemory->getData();
+		SlabHeader* header = getHeader(memory);
+		mGatheredParticles = 0;
+		for (int i = 0; i < mNumSlabs; ++i) {
+			SlabState* slab = getSlab(memory, i);
+			mCounts[i] = slab->count;
+			mGatheredParticles += slab->count;
+			if (slab->count > 0)
+				mVbo->bufferSubData(mFirsts[i] * sizeof(SlabParticle), slab->count * sizeof(SlabParticle), getParticles(slab));
+		}
+		mStepReady = false;
+		header->requestedStep.store(header->requestedStep.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	if (mGatheredParticles == 0) return;
+
+	gl::ScopedBlend blendScope(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	gl::ScopedVao vaoScope(mVao);
+	gl::ScopedGlslProg glslScope(mRenderProgRef);
+	gl::ScopedState stateScope(GL_PROGRAM_POINT_SIZE, true);
+	// Slab particles are never dead. The start time array stays disabled in the
+	// vao, so the shader reads this constant instead.
+	gl::vertexAttrib1f(2, 0.0f);
+	mRenderProgRef->uniform("PointSize", mPointSize);
+	gl::setDefaultShaderVars();
+	glMultiDrawArrays(GL_POINTS, mFirsts.data(), mCounts.data(), GLsizei(mNumSlabs));
+}
+
+int runSlabWorker(const std::string& name, int index)
+{
+	std::unique_ptr<SharedMemory> memory(SharedMemory::open(name));
+	if (!memory || getHeader(memory->getData())->magic != SLAB_MAGIC) return 1;
+	SlabHeader* header = getHeader(memory->getData());
+	if (index < 0 || index >= header->numSlabs) return 1;
+	SlabState* slab = getSlab(memory->getData(), index);
+#if defined( __linux__ )
+	// Linux kills the worker right away, the check in the loops covers the rest
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+
+	while (!header->stop.load(std::memory_order_acquire) && isCoordinatorAlive(header)) {
+		uint32_t requested = header->requestedStep.load(std::memory_order_acquire);
+		if (requested == slab->completedStep.load(std::memory_order_relaxed)) {
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+			continue;
+		}
+		stepSlab(memory->getData(), index);
+		slab->migratedStep.store(requested, std::memory_order_release);
+
+		// Takes in this step's migrants, so no particle is left in a queue when
+		// the coordinator draws the step
+		SlabState* lower = index > 0 ? getSlab(memory->getData(), index - 1) : nullptr;
+		SlabState* upper = index < header->numSlabs - 1 ? getSlab(memory->getData(), index + 1) : nullptr;
+		while (!hasMigrated(lower, requested) || !hasMigrated(upper, requested)) {
+			if (header->stop.load(std::memory_order_acquire) || !isCoordinatorAlive(header)) return 0;
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+		receiveMigrants(memory->getData(), index);
+		slab->completedStep.store(requested, std::memory_order_release);
+	}
+	return 0;
+}
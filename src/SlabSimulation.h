@@ -0,0 +1,94 @@
+#pragma once
+#include "cinder/app/App.h"
+#include "cinder/gl/gl.h"
+#include "cinder/AxisAlignedBox.h"
+#include "SharedMemory.h"
+#include "SpscQueue.h"
+#include <memory>
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+// Command line switch that turns a copy of the executable into a slab worker,
+// followed by the shared memory name and the slab index
+#define SLAB_WORKER_ARG "--slab-worker"
+
+struct SlabParticle {
+	vec3 position;
+	vec3 velocity;
+};
+
+const uint32_t SLAB_QUEUE_CAPACITY = 4096;
+typedef SpscQueue<SlabParticle, SLAB_QUEUE_CAPACITY> MigrationQueue;
+
+// Start of the shared segment, written once by the coordinator except for the counters
+struct SlabHeader {
+	uint32_t magic;
+	int numSlabs;
+	int capacity; /* Particles per slab */
+	vec3 domainMin, domainMax;
+	float timestep, bounciness, dragCoefficient;
+	std::atomic<uint32_t> requestedStep;
+	std::atomic<int> stop;
+	int coordinator; /* Process id, workers exit once it is gone */
+};
+
+// One per slab, followed in memory by its particles. Each slab is the only
+// producer of its two outgoing queues and the only consumer of the matching
+// queues of its neighbours, so every queue has one writer and one reader.
+struct SlabState {
+	std::atomic<uint32_t> migratedStep; /* Step whose leaving particles are all queued */
+	std::atomic<uint32_t> completedStep;
+	int count;
+	MigrationQueue toLower, toUpper;
+};
+
+// Splits a box into slabs along x, each simulated on the CPU by its own worker
+// process. Particles leaving a slab migrate to its neighbour through the
+// queues, and every slab takes in its neighbours' migrants before it completes
+// a step. The coordinator draws the slabs' particle arrays straight from the
+// shared memory. Workers run a step whenever the coordinator requests one, so
+// a slow worker makes the coordinator keep drawing the last complete step
+// instead of blocking.
+class SlabSimulation {
+public:
+	// Seed particles inside the domain start in their slab, up to half its
+	// capacity. Without any, the slabs are filled with random particles.
+	SlabSimulation(int numSlabs, int particlesPerSlab, const AxisAlignedBox& domain, const std::vector<SlabParticle>& seed = {});
+	~SlabSimulation();
+
+	bool isRunning() const { return mMemory != nullptr; }
+	// CPU only, call once per frame. Notes whether the requested step is done.
+	void gather();
+	// Uploads a finished step and requests the next one, then draws the last
+	// uploaded step with the particle shader
+	void draw();
+
+	float mPointSize = 3.0f;
+	int mNumSlabs = 0;
+	int mGatheredParticles = 0;
+	int mCompletedSteps = 0;
+	int mPendingFrames = 0; /* Frames the current step has been waiting for a worker */
+
+private:
+	bool launchWorker(int index);
+	void stopWorkers();
+
+	std::string mName;
+	std::unique_ptr<SharedMemory> mMemory;
+	std::vector<intptr_t> mWorkers; /* Process handles or ids */
+#if defined( CINDER_MSW )
+	void* mJob = nullptr; /* Kills the workers when this process goes away, however it ends */
+#endif
+	std::vector<GLint> mFirsts; /* Start of each slab in the vbo */
+	std::vector<GLsizei> mCounts; /* Particles of each slab in the vbo */
+	bool mStepReady = false; /* Set by gather, the workers are idle until draw requests the next step */
+
+	gl::VboRef mVbo;
+	gl::VaoRef mVao;
+	gl::GlslProgRef mRenderProgRef;
+};
+
+// Entry point of a worker process, returns its exit code
+int runSlabWorker(const std::string& name, int index);
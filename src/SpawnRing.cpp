@@ -0,0 +1,65 @@
+#include "SpawnRing.h"
+
+// Every particle takes two texels, the position and the velocity
+static const int TEXELS_PER_PARTICLE = 2;
+
+SpawnRing::SpawnRing(int capacityPerFrame, int numSections)
+	: mFences("SpawnRing", std::max(numSections, 2))
+{
+	mCapacity = std::max(capacityPerFrame, 1);
+	mNumSections = mFences.getDepth();
+
+	GLsizeiptr size = GLsizeiptr(mCapacity) * mNumSections * TEXELS_PER_PARTICLE * sizeof(vec4);
+	mBuffer = gl::Vbo::create(GL_TEXTURE_BUFFER);
+	gl::ScopedBuffer scopeBuffer(mBuffer);
+	if (gl::isExtensionAvailable("GL_ARB_buffer_storage")) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_TEXTURE_BUFFER, size, nullptr, flags);
+		mMapped = static_cast<vec4*>(glMapBufferRange(GL_TEXTURE_BUFFER, 0, size, flags));
+	}
+	if (!mMapped) {
+		mBuffer->bufferData(size, nullptr, GL_STREAM_DRAW);
+		mStaging.resize(mCapacity * TEXELS_PER_PARTICLE);
+	}
+	mTexture = gl::BufferTexture::create(mBuffer, GL_RGBA32F);
+}
+
+SpawnRing::~SpawnRing()
+{
+	if (mMapped) {
+		gl::ScopedBuffer scopeBuffer(mBuffer);
+		glUnmapBuffer(GL_TEXTURE_BUFFER);
+	}
+}
+
+bool SpawnRing::push(vec3 position, vec3 velocity)
+{
+	if (mCount == mCapacity) return false;
+
+	vec4* texels = mMapped ? mMapped + (mSection * mCapacity + mCount) * TEXELS_PER_PARTICLE
+		: mStaging.data() + mCount * TEXELS_PER_PARTICLE;
+	texels[0] = vec4(position, 1.0f);
+	texels[1] = vec4(velocity, 0.0f);
+	++mCount;
+	return true;
+}
+
+SpawnBatch SpawnRing::flush()
+{
+	SpawnBatch batch;
+	batch.offset = mSection * mCapacity;
+	batch.count = mCount;
+	// The coherent mapping needs no flush, the fallback uploads the section now
+	if (!mMapped && mCount > 0)
+		mBuffer->bufferSubData(batch.offset * TEXELS_PER_PARTICLE * sizeof(vec4), mCount * TEXELS_PER_PARTICLE * sizeof(vec4), mStaging.data());
+	return batch;
+}
+
+void SpawnRing::fence()
+{
+	mFences.fence(mSection);
+	mSection = (mSection + 1) % mNumSections;
+	mCount = 0;
+	// Normally the section was read frames ago and the fence has long passed
+	mFences.waitReleased(mSection);
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "cinder/app/App.h"
+#include "cinder/gl/gl.h"
+#include "cinder/gl/BufferTexture.h"
+#include "FenceRing.h"
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+// A range of the ring filled during one frame, in particles
+struct SpawnBatch {
+	int offset = 0;
+	int count = 0;
+};
+
+// Staging ring for particles created on the CPU. The buffer is split into
+// sections of one frame each. The CPU writes into the current section through
+// a persistent mapping while the GPU reads the older ones, and a fence per
+// section makes sure a section is only reused once the GPU is done with it.
+// Without GL_ARB_buffer_storage the section is written to a CPU copy and
+// uploaded with one glBufferSubData into the released range instead.
+class SpawnRing {
+public:
+	SpawnRing(int capacityPerFrame, int numSections = 3);
+	~SpawnRing();
+
+	// Returns false if the current section is full
+	bool push(vec3 position, vec3 velocity);
+	int getCapacity() const { return mCapacity; }
+	int getPending() const { return mCount; }
+
+	// Makes the current section visible to the GPU and returns its range
+	SpawnBatch flush();
+	// Call after the draw that reads the flushed section. Fences it and moves on
+	// to the next section, waiting for the GPU to release it if necessary.
+	void fence();
+
+	gl::BufferTextureRef getTexture() const { return mTexture; }
+
+	bool isPersistent() const { return mMapped != nullptr; }
+	uint32_t getFenceWaits() const { return mFences.getWaits(); } /* Number of times fence() had to block */
+
+private:
+	int mCapacity, mNumSections;
+	int mSection = 0, mCount = 0;
+	FenceRing mFences;
+	gl::VboRef mBuffer;
+	gl::BufferTextureRef mTexture;
+	vec4* mMapped = nullptr; /* Persistent mapping of the whole ring */
+	std::vector<vec4> mStaging; /* One section, when the buffer can't be mapped */
+};
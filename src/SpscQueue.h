@@ -0,0 +1,45 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "Queues in shared memory need lock-free atomics");
+
+// Lock-free ring for exactly one producer and one consumer, which may live in
+// different processes. It holds nothing but two indices and a fixed array, so
+// it can be placed in shared memory as is. Call init once before first use.
+template<typename T, uint32_t Capacity>
+struct SpscQueue {
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity has to be a power of two");
+
+	void init()
+	{
+		mHead.store(0);
+		mTail.store(0);
+	}
+
+	// Producer side, false if the queue is full
+	bool push(const T& item)
+	{
+		uint32_t tail = mTail.load(std::memory_order_relaxed);
+		if (tail - mHead.load(std::memory_order_acquire) == Capacity) return false;
+		mItems[tail & (Capacity - 1)] = item;
+		mTail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side, false if the queue is empty
+	bool pop(T* item)
+	{
+		uint32_t head = mHead.load(std::memory_order_relaxed);
+		if (head == mTail.load(std::memory_order_acquire)) return false;
+		*item = mItems[head & (Capacity - 1)];
+		mHead.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	// On separate cache lines, so producer and consumer don't share one
+	alignas(64) std::atomic<uint32_t> mHead; /* Next item to pop, written by the consumer */
+	alignas(64) std::atomic<uint32_t> mTail; /* Next free slot, written by the producer */
+	alignas(64) T mItems[Capacity];
+};
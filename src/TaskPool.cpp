@@ -0,0 +1,92 @@
+#include "TaskPool.h"
+
+namespace {
+
+// Queue of the worker running on this thread, -1 outside of the pool
+thread_local int sWorkerIndex = -1;
+
+}
+
+TaskPool::TaskPool(size_t numWorkers)
+{
+	if (numWorkers == 0)
+		numWorkers = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	for (size_t i = 0; i <= numWorkers; ++i)
+		mQueues.emplace_back(new Queue());
+	for (size_t i = 0; i < numWorkers; ++i)
+		mThreads.emplace_back(&TaskPool::workerLoop, this, i);
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mStop = true;
+	}
+	mWake.notify_all();
+	for (auto& thread : mThreads)
+		thread.join();
+}
+
+void TaskPool::submit(std::function<void()> task, TaskGroup* group)
+{
+	if (group) ++group->mRemaining;
+	size_t index = sWorkerIndex >= 0 ? size_t(sWorkerIndex) : mQueues.size() - 1;
+	{
+		std::lock_guard<std::mutex> lock(mQueues[index]->mutex);
+		mQueues[index]->tasks.push_back({ std::move(task), group });
+	}
+	// Counted under the sleep mutex, so a worker can't miss the wakeup
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		++mPending;
+	}
+	mWake.notify_one();
+}
+
+bool TaskPool::runOne(size_t self)
+{
+	Task task;
+	bool found = false;
+	// Own queue from the back, the others from the front
+	for (size_t i = 0; i < mQueues.size() && !found; ++i) {
+		size_t index = (self + i) % mQueues.size();
+		Queue& queue = *mQueues[index];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty()) continue;
+		if (i == 0) {
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		else {
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		found = true;
+	}
+	if (!found) return false;
+
+	--mPending;
+	task.run();
+	if (task.group) --task.group->mRemaining;
+	return true;
+}
+
+void TaskPool::waitUntil(const std::function<bool()>& done)
+{
+	size_t self = sWorkerIndex >= 0 ? size_t(sWorkerIndex) : mQueues.size() - 1;
+	while (!done()) {
+		if (!runOne(self)) std::this_thread::yield();
+	}
+}
+
+void TaskPool::workerLoop(size_t index)
+{
+	sWorkerIndex = int(index);
+	for (;;) {
+		if (runOne(index)) continue;
+		std::unique_lock<std::mutex> lock(mSleepMutex);
+		mWake.wait(lock, [&] { return mStop || mPending > 0; });
+		if (mStop) return;
+	}
+}
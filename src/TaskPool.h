@@ -0,0 +1,58 @@
+#pragma once
+#include "cinder/Noncopyable.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counts the unfinished tasks submitted with it
+class TaskGroup : private ci::Noncopyable {
+public:
+	bool isDone() const { return mRemaining.load() == 0; }
+
+private:
+	friend class TaskPool;
+	std::atomic<int> mRemaining{ 0 };
+};
+
+// Work-stealing thread pool. Every worker has its own deque: it takes its own
+// newest task first, and when it runs dry steals the oldest task of another
+// queue. Tasks submitted from outside the pool go into one extra shared queue.
+// Tasks must not touch GL, the context only lives on the main thread.
+class TaskPool : private ci::Noncopyable {
+public:
+	// By default one worker per core, minus the main thread
+	explicit TaskPool(size_t numWorkers = 0);
+	~TaskPool();
+
+	void submit(std::function<void()> task, TaskGroup* group = nullptr);
+	// Runs tasks on the calling thread until done() returns true
+	void waitUntil(const std::function<bool()>& done);
+	void wait(const TaskGroup& group) { waitUntil([&] { return group.isDone(); }); }
+
+	size_t getNumWorkers() const { return mThreads.size(); }
+
+private:
+	struct Task {
+		std::function<void()> run;
+		TaskGroup* group;
+	};
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	bool runOne(size_t self);
+	void workerLoop(size_t index);
+
+	std::vector<std::unique_ptr<Queue>> mQueues; /* One per worker, plus the shared one at the end */
+	std::vector<std::thread> mThreads;
+	std::mutex mSleepMutex;
+	std::condition_variable mWake;
+	std::atomic<int> mPending{ 0 };
+	bool mStop = false; /* Guarded by mSleepMutex */
+};